@@ -15,6 +15,12 @@ int ngx_yy_sec_waf_unescape(ngx_str_t *str);
 u_char *ngx_yy_sec_waf_itoa(ngx_pool_t *p, ngx_int_t n);
 u_char *ngx_yy_sec_waf_uitoa(ngx_pool_t *p, ngx_uint_t n);
 
+void ngx_yy_sec_waf_simd_init(void);
+u_char *ngx_yy_sec_waf_memmem(u_char *p, size_t len, u_char *s, size_t n);
+size_t ngx_yy_sec_waf_plain_len(u_char *p, size_t len);
+void ngx_yy_sec_waf_crlf_to_space(u_char *p, size_t len, ngx_uint_t nul);
+size_t ngx_yy_sec_waf_count_byte(u_char *p, size_t len, u_char c);
+
 #define REQUEST_HEADER_PHASE    1
 #define REQUEST_BODY_PHASE      2
 #define RESPONSE_HEADER_PHASE   4
@@ -23,6 +29,19 @@ u_char *ngx_yy_sec_waf_uitoa(ngx_pool_t *p, ngx_uint_t n);
 #define PROCESS_ARGS      1
 #define PROCESS_ARGS_POST 2
 
+#define COLLECTION_NONE       0
+#define COLLECTION_ARGS_GET   1
+#define COLLECTION_ARGS_POST  2
+#define COLLECTION_ARGS_NAMES 3
+#define COLLECTION_ARGS_KEY   4
+#define COLLECTION_REQUEST_BODY 5
+#define COLLECTION_JSON_ARGS  6
+#define COLLECTION_JSON_ARGS_NAMES 7
+#define COLLECTION_RESPONSE_BODY 8
+
+#define PREFILTER_STR   1
+#define PREFILTER_REGEX 2
+
 #define ACTION_NONE    0
 #define ACTION_LOG     1
 #define ACTION_BLOCK   2
@@ -35,9 +54,39 @@ extern ngx_atomic_t	  *request_blocked;
 extern ngx_atomic_t	  *request_allowed;
 extern ngx_atomic_t	  *request_logged;
 
+typedef struct {
+    ngx_str_t   str;
+    ngx_uint_t  id;
+} ngx_http_yy_sec_waf_ac_pattern_t;
+
+typedef struct {
+    /* byte -> column of the transition table */
+    uint16_t    classes[256];
+    ngx_uint_t  nclasses;
+    ngx_uint_t  nstates;
+
+    uint32_t   *delta;
+    /* first pattern ending in a state, plus one */
+    uint32_t   *out;
+    /* nearest state on the failure chain with an output */
+    uint32_t   *dict;
+    /* next pattern ending in the same state, plus one */
+    uint32_t   *next;
+    ngx_uint_t *ids;
+} ngx_http_yy_sec_waf_ac_t;
+
+typedef struct {
+    /* nginx variable, or NGX_ERROR for a collection */
+    ngx_int_t   var_index;
+    /* COLLECTION_*, whose elements are checked one by one */
+    ngx_uint_t  collection;
+    ngx_str_t   key; /* ARGS:key */
+} ngx_http_yy_sec_waf_target_t;
+
 typedef struct ngx_http_yy_sec_waf_rule {
     ngx_str_t *str; /* STR */
     ngx_http_regex_t *regex; /* REG */
+    ngx_array_t *regex_literals; /* one of them is in every match of regex */
     ngx_str_t *eq; /* EQ */
     ngx_str_t *gt;
     ngx_str_t *gids; /* GIDS */
@@ -45,27 +94,110 @@ typedef struct ngx_http_yy_sec_waf_rule {
     ngx_int_t  rule_id;
     ngx_int_t  phase;
 
-    /*target variable index array*/
-    ngx_array_t  var_index;
+    /* ngx_http_yy_sec_waf_target_t */
+    ngx_array_t  targets;
+    /* position of each target variable in the vars of the phase */
+    ngx_uint_t  *var_slot;
 
     /* operators*/
     ngx_flag_t op_negative;
 
     void *op_metadata;
     void *action_metadata;
-    void *tfn_metadata;
+    ngx_array_t *tfns; /* re_tfns_metadata *, applied in order */
+    ngx_uint_t   tfn_chain; /* distinct tfns of the phase, 1 based */
 
     /* actions*/
     ngx_flag_t     action_level;
     ngx_uint_t     status;
     ngx_flag_t     is_chain;
+
+    /* targets an ARGS variable, so the args must be parsed */
+    ngx_flag_t     need_args;
+    /* targets REQUEST_BODY, so it runs while the body streams in */
+    ngx_flag_t     request_body;
+    /* targets RESPONSE_BODY, so it runs on the buffers of the response */
+    ngx_flag_t     response_body;
+    /* targets a JSON collection, so a json body must be tokenized */
+    ngx_flag_t     need_json;
+
+    /* PREFILTER_*, only executed when a phase automaton reported it */
+    ngx_uint_t     prefiltered;
+
+    /* in the shared zone, how often regex_literals was checked and how
+       often pcre was skipped, for $WAF_REGEX_STATS */
+    ngx_atomic_t  *regex_stats;
 } ngx_http_yy_sec_waf_rule_t;
 
+typedef struct {
+    ngx_http_yy_sec_waf_target_t target;
+    /* str: rules targeting this variable */
+    ngx_http_yy_sec_waf_ac_t *str_ac;
+    /* required literals of the regex: rules targeting this variable */
+    ngx_http_yy_sec_waf_ac_t *regex_ac;
+} ngx_http_yy_sec_waf_var_t;
+
+typedef struct {
+    ngx_array_t  *rules;
+    /* ngx_http_yy_sec_waf_var_t, every variable targeted by the rules */
+    ngx_array_t  *vars;
+    /* PREFILTER_* of the rules compiled in */
+    ngx_uint_t    prefiltered;
+    /* distinct tfn chains of the rules */
+    ngx_uint_t    ntfn_chains;
+    ngx_flag_t    need_args;
+    ngx_flag_t    need_json;
+    /* a rule targets RESPONSE_BODY */
+    ngx_flag_t    response_body;
+} ngx_http_yy_sec_waf_phase_t;
+
 typedef struct {
     ngx_http_regex_t *regex;
     ngx_int_t         idx;
 } ngx_http_yy_sec_waf_block_list_t;
 
+/* ip_allow_list and ip_deny_list, the networks read from their files */
+typedef struct {
+    ngx_radix_tree_t  *tree;
+#if (NGX_HAVE_INET6)
+    ngx_radix_tree_t  *tree6;
+#endif
+} ngx_http_yy_sec_waf_ip_list_t;
+
+/* yy_sec_waf_zone, the connections counted per key in shared memory */
+typedef struct {
+    ngx_str_t                  name;
+    ngx_str_t                  key_text;
+    ngx_http_complex_value_t   key;
+    /* the key is the client address, one entry for each prefix */
+    ngx_flag_t                 addr;
+    ngx_uint_t                 ipv4_prefix;
+    ngx_uint_t                 ipv6_prefix;
+    /* rate=, the usec between two requests at the rate, 0 if none */
+    ngx_uint_t                 interval;
+    /* an rbtree under the zone mutex instead of the lock-free table */
+    ngx_flag_t                 rbtree;
+    /* in ngx_http_request_ctx_t conn and in the data of its variable */
+    ngx_uint_t                 index;
+    ngx_shm_zone_t            *shm_zone;
+} ngx_http_yy_sec_waf_zone_t;
+
+/* yy_sec_waf_ban, clients blocked too often are turned away for a time */
+typedef struct {
+    ngx_uint_t       blocks;
+    ngx_msec_t       window;
+    ngx_msec_t       time;
+    ngx_uint_t       ipv6_prefix;
+    ngx_shm_zone_t  *shm_zone;
+} ngx_http_yy_sec_waf_ban_t;
+
+typedef struct {
+    /* ngx_http_yy_sec_waf_zone_t *, all counted by conn_processor */
+    ngx_array_t  zones;
+    /* NULL without yy_sec_waf_ban */
+    ngx_http_yy_sec_waf_ban_t *ban;
+} ngx_http_yy_sec_waf_main_conf_t;
+
 typedef struct {
     /* ngx_http_yy_sec_waf_rule_t */
     ngx_array_t *request_header_rules;
@@ -73,42 +205,134 @@ typedef struct {
     ngx_array_t *response_header_rules;
     ngx_array_t *response_body_rules;
     ngx_array_t *block_list;
+    /* looked up once for the client address, before the rules */
+    ngx_http_yy_sec_waf_ip_list_t *ip_allow_list;
+    ngx_http_yy_sec_waf_ip_list_t *ip_deny_list;
+
+    /* compiled from the rule arrays above at merge time */
+    ngx_http_yy_sec_waf_phase_t *request_header_phase;
+    ngx_http_yy_sec_waf_phase_t *request_body_phase;
+    ngx_http_yy_sec_waf_phase_t *response_header_phase;
+    ngx_http_yy_sec_waf_phase_t *response_body_phase;
 
-    ngx_shm_zone_t *shm_zone;
     ngx_str_t  server_ip;
     ngx_str_t  denied_url;
     ngx_flag_t enabled;
     ngx_flag_t conn_processor;
     ngx_flag_t body_processor;
+    ngx_flag_t regex_set;
+    /* bigger bodies are refused from their Content-Length, 0 is no limit */
+    size_t     body_limit;
+    /* only the first bytes of the body are inspected, 0 is all of it */
+    size_t     body_inspect_limit;
+    /* REQUEST_BODY rules run on each buffer as it arrives */
+    ngx_flag_t body_streaming;
+    /* bytes kept from one streamed buffer to the next */
+    size_t     body_streaming_window;
+    /* a json body nested deeper, or with a longer key or value, is refused */
+    ngx_uint_t json_depth_limit;
+    size_t     json_value_limit;
+    /* a body sent with Content-Encoding gzip or deflate is inflated, up to
+       body_inflate_limit bytes and body_inflate_ratio times its size */
+    ngx_flag_t body_inflate;
+    size_t     body_inflate_limit;
+    ngx_uint_t body_inflate_ratio;
+    /* only the first bytes of the response are inspected, 0 is all of it */
+    size_t     response_body_limit;
+    /* the RESPONSE_BODY rules only see responses of these types */
+    ngx_hash_t   response_body_types;
+    ngx_array_t *response_body_types_keys;
+
+    /* set at merge time if any rule reads the args */
+    ngx_flag_t need_args;
+    /* set at merge time if any rule reads JSON_ARGS or JSON_ARGS_NAMES */
+    ngx_flag_t need_json;
+    /* set at merge time if the body is read, body_processor and rules */
+    ngx_flag_t need_body;
 } ngx_http_yy_sec_waf_loc_conf_t;
 
+typedef struct {
+    ngx_str_t   name;
+    ngx_str_t   value; /* as sent, not url decoded */
+    ngx_uint_t  flag; /* PROCESS_ARGS or PROCESS_ARGS_POST */
+
+    /* filled in when a collection first needs them */
+    ngx_str_t   decoded_name;
+    ngx_str_t   decoded_value;
+    ngx_uint_t  next; /* in the same hash bucket, plus one */
+} ngx_http_yy_sec_waf_arg_t;
+
+/* the elements of a variable, a plain variable has one */
+typedef struct {
+    ngx_str_t  *elts;
+    ngx_uint_t  nelts;
+} ngx_http_yy_sec_waf_value_t;
+
+/* state of the multipart parser, see ngx_yy_sec_waf_multipart.c */
+typedef struct ngx_http_yy_sec_waf_multipart_s  ngx_http_yy_sec_waf_multipart_t;
+
+/* state of the json tokenizer, see ngx_yy_sec_waf_json.c */
+typedef struct ngx_http_yy_sec_waf_json_s  ngx_http_yy_sec_waf_json_t;
+
+/* zlib state of a compressed body, see ngx_yy_sec_waf_inflate.c */
+typedef struct ngx_http_yy_sec_waf_inflate_s  ngx_http_yy_sec_waf_inflate_t;
+
 typedef struct {
     ngx_http_request_t *r;
     ngx_pool_t *pool;
     ngx_http_yy_sec_waf_loc_conf_t *cf;
     ngx_int_t  phase;
 
+    /* rules of the current phase reported by an automaton */
+    u_char    *candidates;
+
+    /* values of the phase variables, fetched once per phase */
+    ngx_array_t                  *vars;
+    ngx_http_yy_sec_waf_value_t  *values;
+    /* values after each tfn chain, indexed by slot and chain */
+    ngx_uint_t                    ntfn_chains;
+    ngx_http_yy_sec_waf_value_t  *tfn_values;
+
+    /* allocations of one phase, reset between streamed buffers */
+    ngx_pool_t  *scratch_pool;
+    ngx_pool_t  *stream_pool;
+
     ngx_rbtree_t cache_rbtree;
     ngx_rbtree_node_t cache_sentinel;
+    /* bytes allocated to build variables, $WAF_ALLOC_BYTES */
+    size_t       alloc_bytes;
+    /* bytes of the request copied, $WAF_COPY_BYTES */
+    size_t       copy_bytes;
 
-    ngx_str_t  args;
-
-    ngx_str_t  post_args;
+    /* ngx_http_yy_sec_waf_arg_t, offsets into r->args and the body */
+    ngx_array_t args;
     ngx_uint_t post_args_count;
+    /* args decoded so far, and the buckets of their names, plus one */
+    ngx_uint_t  args_decoded;
+    ngx_uint_t *args_hash;
+    ngx_uint_t  args_hash_size;
 
     ngx_str_t  *real_client_ip;
     ngx_str_t  *server_ip;
 
     u_char     *boundary;
     ngx_uint_t  boundary_len;
+    ngx_http_yy_sec_waf_multipart_t *multipart;
     ngx_array_t multipart_filename;
     ngx_array_t multipart_name;
     ngx_array_t content_type;
 
+    /* keys and leaf values of a json body, JSON_ARGS_NAMES and JSON_ARGS */
+    ngx_http_yy_sec_waf_json_t *json;
+    ngx_array_t json_names;
+    ngx_array_t json_args;
+
     ngx_int_t  process_body_error;
     ngx_str_t  process_body_error_msg;
-    ngx_uint_t post_args_len;
-    ngx_uint_t conn_per_ip;
+    /* the connections of each yy_sec_waf_zone, by its index, and how many
+       requests the key is ahead of the rate of the zone */
+    ngx_uint_t *conn;
+    ngx_uint_t *rate;
     ngx_int_t  var_index;
     ngx_str_t  var;
 
@@ -118,6 +342,10 @@ typedef struct {
 
     /* state */
     ngx_flag_t    process_done:1;
+    ngx_flag_t    header_phase_done:1;
+    ngx_flag_t    response_phase_done:1;
+    /* set by the header filter, the RESPONSE_BODY rules skip the response */
+    ngx_flag_t    response_bypass:1;
     ngx_flag_t    read_body_done:1;
     ngx_flag_t    waiting_more_body:1;
 
@@ -127,15 +355,98 @@ typedef struct {
     ngx_str_t    *msg;
     ngx_str_t    *raw_string;
     ngx_str_t    *full_body;
+
+    /* REQUEST_BODY, the body copy or the window being streamed */
+    ngx_str_t    *request_body;
+    ngx_str_t     body_window;
+    size_t        body_window_size;
+    /* bytes of the window already inspected with the previous buffers */
+    size_t        body_window_kept;
+    /* COLLECTION_REQUEST_BODY or COLLECTION_RESPONSE_BODY while its window
+       is inspected */
+    ngx_uint_t    body_streaming;
+    ngx_http_yy_sec_waf_inflate_t *inflate;
+    /* an urlencoded body inspected as a stream is kept for its args */
+    ngx_flag_t    stream_form;
+    ngx_str_t     form_body;
+    size_t        form_body_size;
+
+    /* RESPONSE_BODY, the window of the response being sent */
+    ngx_str_t    *response_body;
+    ngx_str_t     response_window;
+    size_t        response_window_size;
+    size_t        response_window_kept;
+    size_t        response_inspected;
 } ngx_http_request_ctx_t;
 
 ngx_int_t ngx_http_yy_sec_waf_process_conn(ngx_http_request_ctx_t *ctx);
 
-ngx_shm_zone_t *ngx_http_yy_sec_waf_create_shm_zone(ngx_conf_t *cf);
+char *ngx_http_yy_sec_waf_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_http_yy_sec_waf_default_zone(ngx_conf_t *cf);
+
+char *ngx_http_yy_sec_waf_ban(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_int_t ngx_http_yy_sec_waf_ban_check(ngx_http_request_t *r);
+void ngx_http_yy_sec_waf_ban_block(ngx_http_request_t *r);
+
+char *ngx_http_yy_sec_waf_ip_list(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_int_t ngx_http_yy_sec_waf_ip_list_find(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_ip_list_t *list);
+
+ngx_int_t ngx_http_yy_sec_waf_addr_key(ngx_http_request_t *r,
+    ngx_uint_t ipv4_prefix, ngx_uint_t ipv6_prefix, u_char *key, size_t *len);
+ngx_int_t ngx_http_yy_sec_waf_get_conn(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+ngx_int_t ngx_http_yy_sec_waf_get_rate(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+ngx_int_t ngx_http_yy_sec_waf_get_regex_stats(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+
+u_char *ngx_http_yy_sec_waf_decode_arg(u_char *dst, ngx_str_t *str);
 
 ngx_int_t ngx_http_yy_sec_waf_process_body(ngx_http_request_t *r,
     ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx);
 
+ngx_int_t ngx_http_yy_sec_waf_stream_body(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx,
+    ngx_chain_t *in);
+
+ngx_int_t ngx_http_yy_sec_waf_multipart_init(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx);
+
+ngx_int_t ngx_http_yy_sec_waf_multipart_feed(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, size_t len);
+
+ngx_int_t ngx_http_yy_sec_waf_multipart_finish(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx);
+
+ngx_int_t ngx_http_yy_sec_waf_json_init(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx);
+
+ngx_int_t ngx_http_yy_sec_waf_json_feed(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, size_t len);
+
+ngx_int_t ngx_http_yy_sec_waf_json_finish(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx);
+
+ngx_int_t ngx_http_yy_sec_waf_inflate_init(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx);
+
+void ngx_http_yy_sec_waf_inflate_input(ngx_http_request_ctx_t *ctx,
+    u_char *p, size_t len);
+
+ngx_int_t ngx_http_yy_sec_waf_inflate_output(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_str_t *out);
+
+ngx_int_t ngx_http_yy_sec_waf_inflate_finish(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx);
+
+ngx_int_t ngx_http_yy_sec_waf_stream_response(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx,
+    ngx_chain_t *in);
+
 ngx_int_t ngx_http_yy_sec_waf_process_spliturl(ngx_http_request_t *r,
     ngx_str_t *str, ngx_http_request_ctx_t *ctx, ngx_int_t flag);
 
@@ -0,0 +1,392 @@
+#include "ngx_yy_sec_waf.h"
+
+/* slots probed from the hash of an address */
+#define YY_SEC_WAF_BAN_PROBES  16
+
+typedef struct {
+    /* when the ban ends, read without the lock */
+    ngx_atomic_t        until;
+    /* the first block of the window, and the blocks since */
+    ngx_msec_t          start;
+    ngx_uint_t          blocks;
+    /* 0 for a slot never used, which ends a probe */
+    u_char              len;
+    u_char              addr[16];
+} yy_sec_waf_ban_slot_t;
+
+
+typedef struct {
+    ngx_uint_t              mask;
+    yy_sec_waf_ban_slot_t   slots[1];
+} yy_sec_waf_ban_table_t;
+
+
+typedef struct {
+    yy_sec_waf_ban_table_t  *table;
+    ngx_http_yy_sec_waf_ban_t *ban;
+} yy_sec_waf_ban_ctx_t;
+
+/*
+** @description: This function is called to init the shm zone of the ban table.
+** @para: ngx_shm_zone_t *shm_zone
+** @para: void *data
+** @return: static ngx_int_t.
+*/
+
+static ngx_int_t
+yy_sec_waf_ban_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    yy_sec_waf_ban_ctx_t  *octx = data;
+
+    size_t                 len;
+    ngx_uint_t             n;
+    ngx_slab_pool_t       *shpool;
+    yy_sec_waf_ban_ctx_t  *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        ctx->table = octx->table;
+
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->table = shpool->data;
+
+        return NGX_OK;
+    }
+
+    /* half of the zone, the rest is left to the slab allocator */
+    for (n = 1;
+         (n << 1) * sizeof(yy_sec_waf_ban_slot_t) <= shm_zone->shm.size / 2;
+         n <<= 1)
+    { /* void */ }
+
+    ctx->table = ngx_slab_alloc(shpool, offsetof(yy_sec_waf_ban_table_t, slots)
+                                        + n * sizeof(yy_sec_waf_ban_slot_t));
+    if (ctx->table == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(ctx->table->slots, n * sizeof(yy_sec_waf_ban_slot_t));
+    ctx->table->mask = n - 1;
+
+    shpool->data = ctx->table;
+
+    len = sizeof("[ysec_waf] in yy_sec_waf_ban \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, "[ysec_waf] in yy_sec_waf_ban \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called first for a request, to turn away
+** a client banned, with one lookup and no lock.
+** @para: ngx_http_request_t *r
+** @return: NGX_DECLINED or the status if banned.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_ban_check(ngx_http_request_t *r)
+{
+    u_char                            key[16];
+    size_t                            len;
+    uint32_t                          hash;
+    ngx_uint_t                        n;
+    ngx_msec_int_t                    left;
+    yy_sec_waf_ban_ctx_t             *ctx;
+    yy_sec_waf_ban_slot_t            *slot;
+    ngx_http_yy_sec_waf_main_conf_t  *mcf;
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_yy_sec_waf_module);
+
+    if (mcf->ban == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_yy_sec_waf_addr_key(r, 32, mcf->ban->ipv6_prefix, key, &len)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    ctx = mcf->ban->shm_zone->data;
+    hash = ngx_crc32_short(key, len);
+
+    for (n = 0; n < YY_SEC_WAF_BAN_PROBES && n <= ctx->table->mask; n++) {
+        slot = &ctx->table->slots[(hash + n) & ctx->table->mask];
+
+        if (slot->len == 0) {
+            break;
+        }
+
+        if (slot->len != len || ngx_memcmp(slot->addr, key, len) != 0) {
+            continue;
+        }
+
+        left = (ngx_msec_int_t) (slot->until - ngx_current_msec);
+
+        if (slot->until == 0 || left <= 0) {
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "[ysec_waf] banned for %M more", (ngx_msec_t) left);
+
+        return NGX_HTTP_PRECONDITION_FAILED;
+    }
+
+    return NGX_DECLINED;
+}
+
+/*
+** @description: This function is called when a request is blocked, to ban
+** its client once it is blocked often enough within the window.
+** @para: ngx_http_request_t *r
+** @return: void
+*/
+
+void
+ngx_http_yy_sec_waf_ban_block(ngx_http_request_t *r)
+{
+    u_char                            key[16];
+    size_t                            len;
+    uint32_t                          hash;
+    ngx_uint_t                        n;
+    ngx_msec_t                        now;
+    ngx_slab_pool_t                  *shpool;
+    yy_sec_waf_ban_ctx_t             *ctx;
+    yy_sec_waf_ban_slot_t            *slot, *free;
+    ngx_http_yy_sec_waf_ban_t        *ban;
+    ngx_http_yy_sec_waf_main_conf_t  *mcf;
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_yy_sec_waf_module);
+
+    ban = mcf->ban;
+
+    if (ban == NULL) {
+        return;
+    }
+
+    if (ngx_http_yy_sec_waf_addr_key(r, 32, ban->ipv6_prefix, key, &len)
+        != NGX_OK)
+    {
+        return;
+    }
+
+    ctx = ban->shm_zone->data;
+    shpool = (ngx_slab_pool_t *) ban->shm_zone->shm.addr;
+    hash = ngx_crc32_short(key, len);
+    now = ngx_current_msec;
+    free = NULL;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (n = 0; n < YY_SEC_WAF_BAN_PROBES && n <= ctx->table->mask; n++) {
+        slot = &ctx->table->slots[(hash + n) & ctx->table->mask];
+
+        if (slot->len == len && ngx_memcmp(slot->addr, key, len) == 0) {
+            goto found;
+        }
+
+        if (free != NULL) {
+            continue;
+        }
+
+        /* a slot with nothing left to remember is free */
+        if (slot->len == 0
+            || ((ngx_msec_int_t) (slot->until - now) <= 0
+                && now - slot->start >= ban->window))
+        {
+            free = slot;
+        }
+
+        if (slot->len == 0) {
+            break;
+        }
+    }
+
+    if (free == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "[ysec_waf] yy_sec_waf_ban is full");
+        return;
+    }
+
+    slot = free;
+
+    /* the lookup without the lock sees no ban while the key changes */
+    slot->until = 0;
+    ngx_memory_barrier();
+
+    ngx_memcpy(slot->addr, key, len);
+    slot->len = (u_char) len;
+    slot->start = now;
+    slot->blocks = 0;
+
+found:
+
+    if (now - slot->start >= ban->window) {
+        slot->start = now;
+        slot->blocks = 0;
+    }
+
+    if (++slot->blocks >= ban->blocks) {
+        slot->until = now + ban->time;
+        slot->start = now;
+        slot->blocks = 0;
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "[ysec_waf] client banned for %M", ban->time);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+/*
+** @description: This function is called to read yy_sec_waf_ban, as
+** [blocks=N] [window=TIME] [time=TIME] [size=SIZE] [ipv6_prefix=N].
+** @para: ngx_conf_t *cf
+** @para: ngx_command_t *cmd
+** @para: void *conf
+** @return: char *
+*/
+
+char *
+ngx_http_yy_sec_waf_ban(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_yy_sec_waf_main_conf_t *mcf = conf;
+
+    ssize_t                     size;
+    ngx_int_t                   n;
+    ngx_str_t                  *value, s, name;
+    ngx_uint_t                  i;
+    yy_sec_waf_ban_ctx_t       *ctx;
+    ngx_http_yy_sec_waf_ban_t  *ban;
+
+    if (mcf->ban != NULL) {
+        return "is duplicate";
+    }
+
+    ban = ngx_pcalloc(cf->pool, sizeof(ngx_http_yy_sec_waf_ban_t));
+    if (ban == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ban->blocks = 5;
+    ban->window = 60000;
+    ban->time = 600000;
+    ban->ipv6_prefix = 64;
+    size = 10 * 1024 * 1024;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "blocks=", 7) == 0) {
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ban->blocks = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "window=", 7) == 0) {
+            s.data = value[i].data + 7;
+            s.len = value[i].len - 7;
+
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ban->window = (ngx_msec_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "time=", 5) == 0) {
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ban->time = (ngx_msec_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ipv6_prefix=", 12) == 0) {
+            n = ngx_atoi(value[i].data + 12, value[i].len - 12);
+            if (n == NGX_ERROR || n < 1 || n > 128) {
+                goto invalid;
+            }
+
+            ban->ipv6_prefix = n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[ysec_waf] yy_sec_waf_ban is too small");
+        return NGX_CONF_ERROR;
+    }
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(yy_sec_waf_ban_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->ban = ban;
+
+    ngx_str_set(&name, "yy_sec_waf_ban");
+
+    ban->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                          &ngx_http_yy_sec_waf_module);
+    if (ban->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ban->shm_zone->init = yy_sec_waf_ban_init_zone;
+    ban->shm_zone->data = ctx;
+
+    mcf->ban = ban;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "[ysec_waf] invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
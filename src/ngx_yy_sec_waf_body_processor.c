@@ -2,13 +2,28 @@
 
 extern int
 ngx_yy_sec_waf_unescape_uri(u_char **dst, u_char **src, size_t size, ngx_uint_t type);
+extern ngx_int_t yy_sec_waf_re_process_normal_rules(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx, ngx_uint_t phase);
+
+/* new bytes added to the window before the rules run on it again */
+#define YY_SEC_WAF_STREAM_SLICE  8192
+
+static ngx_int_t yy_sec_waf_stream_init(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx);
+static ngx_int_t yy_sec_waf_stream_input(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx,
+    u_char *p, u_char *last);
+static ngx_int_t yy_sec_waf_stream_end(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx);
 
 /*
 ** @description: This function is called to process spliturl of the request.
+** Only the offsets of each name and value are recorded, nothing is copied
+** or decoded until a rule asks for a value.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_str_t *str
-** @para: ngx_array_t *rules
 ** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_int_t flag
 ** @return: NGX_OK or NGX_ERROR if failed.
 */
 
@@ -16,496 +31,811 @@ ngx_int_t
 ngx_http_yy_sec_waf_process_spliturl(ngx_http_request_t *r,
     ngx_str_t *str, ngx_http_request_ctx_t *ctx, ngx_int_t flag)
 {
-    u_char    *p, *q, *src, *dst, *buffer, *last;
-    ngx_uint_t arg_cnt, parsing_value, buffer_size;
-
-    p = buffer = ngx_palloc(r->pool, str->len);
-    if (p == NULL) {
+    u_char                    *p, *q, *eq, *last;
+    ngx_uint_t                 arg_cnt;
+    ngx_http_yy_sec_waf_arg_t *arg;
+
+    if (ctx->args.elts == NULL
+        && ngx_array_init(&ctx->args, r->pool, 8,
+                          sizeof(ngx_http_yy_sec_waf_arg_t)) != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
-    ngx_memcpy(p, str->data, str->len);
-
-    last = p+str->len;
-    q = p;
-
-    parsing_value = 0;
-    buffer_size = 0;
+    p = str->data;
+    last = str->data + str->len;
     arg_cnt = 0;
 
-    //Only parse value here.
-    while (p <= last) {
-        if (*p == '=' && !parsing_value) {
+    while (p < last) {
+        q = ngx_strlchr(p, last, '&');
+        if (q == NULL) {
+            q = last;
+        }
 
-            p++;
-            q = p;
-			parsing_value = 1;
-        } else if (*p == '&' || p == last) {
+        /* like before, a pair without '=' has no value to check */
+        eq = ngx_strlchr(p, q, '=');
 
-            if (parsing_value) {
-                parsing_value = 0;
-            } else {
-                p++;
-                continue;
+        if (eq != NULL) {
+            arg = ngx_array_push(&ctx->args);
+            if (arg == NULL) {
+                return NGX_ERROR;
             }
 
-            src = dst = q;
-            ngx_yy_sec_waf_unescape_uri(&dst, &src, p-q, 0);
-            ngx_memcpy(buffer+buffer_size, q, (dst-q));
-            buffer_size += dst-q;
+            arg->name.data = p;
+            arg->name.len = eq - p;
+            arg->value.data = eq + 1;
+            arg->value.len = q - (eq + 1);
+            arg->flag = flag;
 
-            if (p != last) {
-                ngx_memcpy(buffer+buffer_size, "$", 1);
-                buffer_size++;
-            }
-            
-            p++;
-            q = p;
             arg_cnt++;
-        } else {
-
-            p++;
         }
-    }
 
-    if (flag == PROCESS_ARGS) {
-        ctx->args.data = buffer;
-        ctx->args.len = buffer_size;
+        p = q + 1;
     }
 
     if (flag == PROCESS_ARGS_POST) {
-
         ctx->post_args_count = arg_cnt;
-        ctx->post_args_len = buffer_size;
-        ctx->post_args.data = buffer;
-        ctx->post_args.len = buffer_size;
     }
 
-    while (buffer_size-- > 0) {
-        if (*buffer == '\r' || *buffer == '\n' || *buffer == '\0') {
-            *buffer = ' ';
-        }
+    return NGX_OK;
+}
 
-        buffer++;
-    }
+/*
+** @description: This function is called to url decode the name or value of an arg.
+** @para: u_char *dst (at least str->len bytes)
+** @para: ngx_str_t *str
+** @return: u_char * (past the decoded string)
+*/
 
-    return NGX_OK;
+u_char *
+ngx_http_yy_sec_waf_decode_arg(u_char *dst, ngx_str_t *str)
+{
+    u_char  *src;
+
+    src = str->data;
+
+    ngx_yy_sec_waf_unescape_uri(&dst, &src, str->len, 0);
+
+    return dst;
 }
 
+typedef struct {
+    void    *addr;
+    size_t   len;
+} yy_sec_waf_body_map_t;
+
+/*
+** @description: This function is called to unmap a body with the request.
+** @para: void *data
+** @return: static void
+*/
+
+static void
+yy_sec_waf_body_unmap(void *data)
+{
+    yy_sec_waf_body_map_t  *map = data;
+
+    if (munmap(map->addr, map->len) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "[ysec_waf] munmap() failed");
+    }
+}
+
+/*
+** @description: This function is called to map a body spooled to a temp
+** file, read only.
+** @para: ngx_http_request_t *r
+** @para: ngx_buf_t *b
+** @para: size_t len
+** @return: static u_char * or NULL if failed.
+*/
+
+static u_char *
+yy_sec_waf_map_body(ngx_http_request_t *r, ngx_buf_t *b, size_t len)
+{
+    u_char                 *p;
+    off_t                   offset;
+    ngx_pool_cleanup_t     *cln;
+    yy_sec_waf_body_map_t  *map;
+
+    /* mmap wants an offset aligned to a page */
+    offset = b->file_pos & ~((off_t) ngx_pagesize - 1);
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(yy_sec_waf_body_map_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    map = cln->data;
+    map->len = (size_t) (b->file_pos - offset) + len;
+
+    map->addr = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, b->file->fd,
+                     offset);
+    if (map->addr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                      "[ysec_waf] mmap() \"%V\" failed", &b->file->name);
+        return NULL;
+    }
+
+    cln->handler = yy_sec_waf_body_unmap;
+
+    p = map->addr;
+
+    return p + (b->file_pos - offset);
+}
 
 /*
-** @description: This function is called to process the boundary of the request.
+** @description: This function is called to get the body of the request as
+** one string, which must not be written to. A single buffer in memory is
+** used as it is, a body in a temp file is mapped, and otherwise the buffers
+** are copied, reading the parts in a file. At most body_inspect_limit bytes.
 ** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
 ** @para: ngx_http_request_ctx_t *ctx
-** @para: ngx_str_t full_body
-** @return: NGX_OK or NGX_ERROR if failed.
+** @return: static ngx_str_t * or NULL if failed.
 */
 
-static ngx_int_t
-ngx_http_yy_sec_waf_process_boundary(ngx_http_request_t *r,
-    u_char **boundary, ngx_uint_t *boundary_len)
+static ngx_str_t *
+yy_sec_waf_read_body(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx)
 {
-    u_char *start;
-    u_char *end;
+    u_char      *src;
+    size_t       len;
+    ssize_t      n;
+    ngx_buf_t   *b;
+    ngx_chain_t *bb;
+    ngx_str_t   *full_body;
 
-    start = r->headers_in.content_type->value.data + ngx_strlen("multipart/form-data;");
-    end = r->headers_in.content_type->value.data + r->headers_in.content_type->value.len;
+    full_body = ngx_palloc(r->pool, sizeof(ngx_str_t));
+    if (full_body == NULL) {
+        return NULL;
+    }
 
-    while (start < end && *start && (*start == ' ' || *start == '\t'))
-        start++;
+    for (full_body->len = 0, bb = r->request_body->bufs; bb; bb = bb->next)
+        full_body->len += ngx_buf_size(bb->buf);
 
-    if (ngx_strncmp(start, "boundary=", ngx_strlen("boundary=")))
-        return NGX_ERROR;
+    if (cf->body_inspect_limit && full_body->len > cf->body_inspect_limit) {
+        full_body->len = cf->body_inspect_limit;
+    }
 
-    start += ngx_strlen("boundary=");
+    b = r->request_body->bufs->buf;
 
-    *boundary_len = end - start;
-    *boundary = start;
+    if (full_body->len
+        && r->request_body->temp_file && !ngx_buf_in_memory(b) && b->in_file
+        && b->file_last - b->file_pos >= (off_t) full_body->len)
+    {
+        full_body->data = yy_sec_waf_map_body(r, b, full_body->len);
 
-    if (*boundary_len > 70)
-        return NGX_ERROR;
+        if (full_body->data != NULL) {
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] post body is mapped from temp_file.");
+            return full_body;
+        }
+    }
 
-    return NGX_OK;
+    /* one buffer in memory is used as it is, it is never written to */
+    if (r->request_body->bufs->next == NULL && ngx_buf_in_memory(b)) {
+        full_body->data = b->pos;
+        return full_body;
+    }
+
+    full_body->data = ngx_pnalloc(r->pool, full_body->len+1);
+
+    if (full_body->data == NULL)
+        return NULL;
+
+    ctx->alloc_bytes += full_body->len + 1;
+    ctx->copy_bytes += full_body->len;
+
+    src = full_body->data;
+
+    for (bb = r->request_body->bufs; bb && src < full_body->data + full_body->len; bb = bb->next) {
+        len = ngx_min((size_t) ngx_buf_size(bb->buf),
+                      (size_t) (full_body->data + full_body->len - src));
+
+        if (ngx_buf_in_memory(bb->buf)) {
+            src = ngx_cpymem(src, bb->buf->pos, len);
+            continue;
+        }
+
+        n = ngx_read_file(bb->buf->file, src, len, bb->buf->file_pos);
+        if (n != (ssize_t) len) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "[ysec_waf] failed to read the body from \"%V\"",
+                          &bb->buf->file->name);
+            return NULL;
+        }
+
+        src += n;
+    }
+
+    *src = '\0';
+
+    return full_body;
 }
 
 /*
-** @description: This function is called to process the disposition of the request.
+** @description: This function is called to process the body of the request.
+** A compressed body is inflated and inspected as a stream, like with
+** body_streaming, so that it is never held inflated as a whole.
 ** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
 ** @para: ngx_http_request_ctx_t *ctx
-** @para: ngx_str_t full_body
-** @return: NGX_OK or NGX_ERROR if failed.
+** @return: NGX_OK, NGX_ERROR if failed or the status of the rule matched.
 */
 
-static ngx_int_t
-ngx_http_yy_sec_waf_process_disposition(ngx_http_request_t *r,
-    u_char *str, u_char *line_end, ngx_str_t *name, ngx_str_t *filename)
+ngx_int_t
+ngx_http_yy_sec_waf_process_body(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx)
 {
-    u_char *name_start, *name_end, *filename_start, *filename_end;
+    ngx_int_t    rc;
+    ngx_str_t   *full_body;
+
+    if (!r->request_body->bufs || !r->headers_in.content_type) {
+        ctx->process_body_error = 1;
+        ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_CONTENT_TYPE");
+        return NGX_ERROR;
+    }
 
-    while (str < line_end) {
-        while(str < line_end && *str && (*str == ' ' || *str == '\t'))
-            str++;
-        if (str < line_end && *str && *str == ';')
-            str++;
-        while (str < line_end && *str && (*str == ' ' || *str == '\t'))
-            str++;
+    full_body = yy_sec_waf_read_body(r, cf, ctx);
+    if (full_body == NULL) {
+        return NGX_ERROR;
+    }
 
-        if (str >= line_end || !*str)
-            break;
+    if (cf->body_inflate) {
+        rc = ngx_http_yy_sec_waf_inflate_init(r, cf, ctx);
 
-        if (!ngx_strncmp(str, "name=\"", ngx_strlen("name=\""))) {
-            name_start = name_end = str + ngx_strlen("name=\"");
-            do {
-                name_end = (u_char*) ngx_strchr(name_end, '"');
-                if (name_end && *(name_end - 1) != '\\')
-                    break;
-                name_end++;
-            } while (name_end && name_end < line_end);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
 
-            if (!name_end || !*name_end)
+        if (rc == NGX_OK) {
+            if (yy_sec_waf_stream_init(r, cf, ctx) != NGX_OK) {
                 return NGX_ERROR;
+            }
 
-            str = name_end;
+            rc = yy_sec_waf_stream_input(r, cf, ctx, full_body->data,
+                                         full_body->data + full_body->len);
 
-            if (str < line_end + 1)
-                str++;
-            else
-                return NGX_ERROR;
+            /* the end of a body cut at body_inspect_limit is not checked */
+            if (rc == NGX_DECLINED && !ctx->process_done
+                && (cf->body_inspect_limit == 0
+                    || full_body->len < cf->body_inspect_limit))
+            {
+                rc = yy_sec_waf_stream_end(r, cf, ctx);
+            }
 
-            name->data = name_start;
-            name->len = name_end - name_start;
+            return (rc == NGX_DECLINED) ? NGX_OK : rc;
         }
-        else if (!ngx_strncmp(str, "filename=\"", ngx_strlen("filename=\""))) {
-            filename_end = filename_start = str + ngx_strlen("filename=\"");
-            do {
-                /* ignore 0x00 for %00 injection situation */
-                filename_end = (u_char*) ngx_strlchr(filename_end, line_end, '"');
-                if (filename_end && *(filename_end - 1) != '\\')
-                    break;
-                filename_end++;
-            } while (filename_end && filename_end < line_end);
-
-            if (!filename_end)
-                return NGX_ERROR;
+    }
 
-            str = filename_end;
-            if (str < line_end + 1)
-                str++;
-            else
-                return NGX_ERROR;
+    ctx->request_body = full_body;
 
-            filename->data = filename_start;
-            filename->len = filename_end - filename_start;
+    //ngx_yy_sec_waf_unescape(full_body);
+
+    if (!ngx_strncasecmp(r->headers_in.content_type->value.data,
+        (u_char*)"multipart/form-data", ngx_strlen("multipart/form-data"))) {
+        /* MULTIPART, the whole body as one buffer */
+        if (ngx_http_yy_sec_waf_multipart_init(r, ctx) == NGX_OK
+            && ngx_http_yy_sec_waf_multipart_feed(r, ctx, full_body->data,
+                                                  full_body->len) == NGX_OK)
+        {
+            ngx_http_yy_sec_waf_multipart_finish(r, ctx);
         }
-        else if (str == line_end - 1)
-            break;
-        else {
-            return NGX_ERROR;
+    } else if (!ngx_strncasecmp(r->headers_in.content_type->value.data,
+        (u_char*)"application/x-www-form-urlencoded", ngx_strlen("application/x-www-form-urlencoded"))) {
+        /* X-WWW-FORM-URLENCODED */
+        ctx->full_body = full_body;
+
+        /* \r and \n become spaces when the args are decoded */
+        if (cf->need_args) {
+            ngx_http_yy_sec_waf_process_spliturl(r, full_body, ctx, PROCESS_ARGS_POST);
+        }
+    } else if (cf->need_json && !ngx_strncasecmp(r->headers_in.content_type->value.data,
+        (u_char*)"application/json", ngx_strlen("application/json"))) {
+        /* JSON, the keys and leaf values only */
+        if (ngx_http_yy_sec_waf_json_init(r, cf, ctx) == NGX_OK
+            && ngx_http_yy_sec_waf_json_feed(r, ctx, full_body->data,
+                                             full_body->len) == NGX_OK)
+        {
+            ngx_http_yy_sec_waf_json_finish(r, ctx);
         }
     }
 
-    if (filename_end > line_end || name_end > line_end)
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to destroy the pool of the
+** streamed buffers with the request.
+** @para: void *data
+** @return: static void
+*/
+
+static void
+yy_sec_waf_stream_pool_cleanup(void *data)
+{
+    ngx_destroy_pool(data);
+}
+
+/*
+** @description: This function is called to create the pool reset after each
+** window, shared by the request and the response.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: static ngx_int_t (NGX_OK or NGX_ERROR if failed)
+*/
+
+static ngx_int_t
+yy_sec_waf_stream_pool(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx)
+{
+    ngx_pool_cleanup_t *cln;
+
+    if (ctx->stream_pool != NULL) {
+        return NGX_OK;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->stream_pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE,
+                                       r->connection->log);
+    if (ctx->stream_pool == NULL) {
         return NGX_ERROR;
+    }
+
+    cln->handler = yy_sec_waf_stream_pool_cleanup;
+    cln->data = ctx->stream_pool;
 
     return NGX_OK;
 }
 
 /*
-** @description: This function is called to process the multipart of the request.
+** @description: This function is called to set up the window, the pool and
+** the body processors for a body inspected as a stream.
 ** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
 ** @para: ngx_http_request_ctx_t *ctx
-** @para: ngx_str_t full_body
-** @return: NGX_OK or NGX_ERROR if failed.
+** @return: static ngx_int_t (NGX_OK or NGX_ERROR if failed)
 */
 
 static ngx_int_t
-ngx_http_yy_sec_waf_process_multipart(ngx_http_request_t *r,
-    ngx_str_t *full_body, ngx_http_request_ctx_t *ctx)
+yy_sec_waf_stream_init(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx)
 {
-    u_char *boundary, *line_start, *line_end, *body_end, *p;
-    ngx_uint_t boundary_len, idx, nullbytes;
-    ngx_str_t name, filename, content_type, *tmp;
+    ngx_str_t          *type;
 
-    boundary = NULL;
-    boundary_len = 0;
+    ctx->body_window_size = cf->body_streaming_window
+                            + YY_SEC_WAF_STREAM_SLICE;
 
-    if (r == NULL || full_body == NULL || ctx == NULL) {
+    ctx->body_window.data = ngx_pnalloc(r->pool, ctx->body_window_size);
+    if (ctx->body_window.data == NULL) {
         return NGX_ERROR;
     }
 
-    if (ngx_http_yy_sec_waf_process_boundary(r, &boundary, &boundary_len) != NGX_OK) {
-        ctx->process_body_error = 1;
-        ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_CONTENT_TYPE");
+    ctx->alloc_bytes += ctx->body_window_size;
+
+    if (yy_sec_waf_stream_pool(r, ctx) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    ctx->boundary = boundary;
-    ctx->boundary_len = boundary_len;
+    if (r->headers_in.content_type == NULL) {
+        return NGX_OK;
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] boundary: %s", boundary);
+    type = &r->headers_in.content_type->value;
+
+    /* the parts, keys and args are parsed as the buffers go by */
+    if (!ngx_strncasecmp(type->data, (u_char*)"multipart/form-data",
+                         ngx_strlen("multipart/form-data")))
+    {
+        (void) ngx_http_yy_sec_waf_multipart_init(r, ctx);
+
+    } else if (cf->need_json
+               && !ngx_strncasecmp(type->data, (u_char*)"application/json",
+                                   ngx_strlen("application/json")))
+    {
+        (void) ngx_http_yy_sec_waf_json_init(r, cf, ctx);
+
+    } else if (cf->need_args
+               && !ngx_strncasecmp(type->data,
+                      (u_char*)"application/x-www-form-urlencoded",
+                      ngx_strlen("application/x-www-form-urlencoded")))
+    {
+        ctx->stream_form = 1;
+    }
 
-    idx = 0;
+    return NGX_OK;
+}
 
-    p = ngx_strlcasestrn(full_body->data, full_body->data+full_body->len, boundary, boundary_len-1);
-    if (p == NULL)
-        return NGX_ERROR;
+/*
+** @description: This function is called to keep the bytes of an urlencoded
+** body streamed, as the args point into it.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: size_t n
+** @return: static ngx_int_t (NGX_OK or NGX_ERROR if failed)
+*/
 
-    full_body->len = full_body->len - (p - full_body->data - 2);
-    full_body->data = p - 2;
+static ngx_int_t
+yy_sec_waf_stream_form(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx,
+    u_char *p, size_t n)
+{
+    u_char  *data;
+    size_t   size;
 
-    while (idx < full_body->len) {
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] request_body: %s, len: %d", full_body->data+idx, full_body->len);
+    if (cf->body_inspect_limit
+        && ctx->form_body.len + n > cf->body_inspect_limit)
+    {
+        n = cf->body_inspect_limit - ctx->form_body.len;
+    }
 
-        if (idx+boundary_len+6 == full_body->len || idx+boundary_len+4 == full_body->len) {
-            if (ngx_strncmp(full_body->data+idx, "--", 2)
-                || ngx_strncmp(full_body->data+idx+2, boundary, boundary_len)
-                || ngx_strncmp(full_body->data+idx+boundary_len+2, "--", 2)) {
-                ctx->process_body_error = 1;
-                ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_FORMAT");
-                return NGX_ERROR;
-            } else
-                break;
-        }
+    if (ctx->form_body.len + n > ctx->form_body_size) {
+        size = ngx_max(2 * ctx->form_body_size, ctx->form_body.len + n);
+        size = ngx_max(size, 1024);
 
-        if ((full_body->len-idx < 4+boundary_len)
-            || full_body->data[idx] != '-'
-            || full_body->data[idx+1] != '-'
-            || ngx_strncmp(full_body->data+idx+2, boundary, boundary_len)
-            || idx+boundary_len+2+2 >= full_body->len
-            || full_body->data[idx+boundary_len+2] != '\r'
-            || full_body->data[idx+boundary_len+2+1] != '\n') {
-            ctx->process_body_error = 1;
-            ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_BOUNDARY");
+        data = ngx_pnalloc(r->pool, size);
+        if (data == NULL) {
             return NGX_ERROR;
         }
 
-        /* plus with 4 for -- and \r\n*/
-        idx += boundary_len + 4;
-        if (ngx_strncasecmp(full_body->data+idx, (u_char*)"content-disposition: form-data;",
-            ngx_strlen("content-disposition: form-data;"))) {
-            ctx->process_body_error = 1;
-            ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_FORMAT");
-            return NGX_ERROR;
-        }
+        ctx->alloc_bytes += size;
 
-        idx += ngx_strlen("content-disposition: form-data;");
+        ngx_memcpy(data, ctx->form_body.data, ctx->form_body.len);
+        ctx->form_body.data = data;
+        ctx->form_body_size = size;
+    }
 
-        /* ignore 0x00 for %00 injection situation */
-        line_end = (u_char*) ngx_strlchr(full_body->data+idx, full_body->data+full_body->len, '\n');
-        if (!line_end) {
-            ctx->process_body_error = 1;
-            ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_FORMAT");
-            return NGX_ERROR;
-        }
+    ngx_memcpy(ctx->form_body.data + ctx->form_body.len, p, n);
+    ctx->form_body.len += n;
+    ctx->copy_bytes += n;
 
-        ngx_memzero(&name, sizeof(ngx_str_t));
-        ngx_memzero(&filename, sizeof(ngx_str_t));
-        ngx_memzero(&content_type, sizeof(ngx_str_t));
+    return NGX_OK;
+}
 
-        ngx_http_yy_sec_waf_process_disposition(r, full_body->data+idx, line_end, &name, &filename);
+/*
+** @description: This function is called to run the REQUEST_BODY or the
+** RESPONSE_BODY rules on the window, the end of the previous buffers
+** followed by the new bytes.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_uint_t phase
+** @return: static ngx_int_t (NGX_DECLINED or the status of the rule)
+*/
 
-        tmp = ngx_array_push(&ctx->multipart_filename);
-        if (tmp == NULL)
-            return NGX_ERROR;
+static ngx_int_t
+yy_sec_waf_stream_window(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx,
+    ngx_uint_t phase)
+{
+    size_t      keep, *kept;
+    ngx_int_t   rc;
+    ngx_str_t  *window;
 
-        ngx_memcpy(tmp, &filename, sizeof(ngx_str_t));
+    if (phase == REQUEST_BODY_PHASE) {
+        window = &ctx->body_window;
+        kept = &ctx->body_window_kept;
+        ctx->request_body = window;
+        ctx->body_streaming = COLLECTION_REQUEST_BODY;
 
-        tmp = ngx_array_push(&ctx->multipart_name);
-        if (tmp == NULL)
-            return NGX_ERROR;
+    } else {
+        window = &ctx->response_window;
+        kept = &ctx->response_window_kept;
+        ctx->response_body = window;
+        ctx->body_streaming = COLLECTION_RESPONSE_BODY;
+    }
 
-        ngx_memcpy(tmp, &name, sizeof(ngx_str_t));
+    ctx->scratch_pool = ctx->stream_pool;
 
-        if (filename.data) {
-            line_start = line_end + 1;
-            line_end = (u_char*) ngx_strchr(line_start, '\n');
-            if (!line_end) {
-                ctx->process_body_error = 1;
-                ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_FORMAT");
-                return NGX_ERROR;
-            }
+    rc = yy_sec_waf_re_process_normal_rules(r, cf, ctx, phase);
 
-            content_type.data = line_start + ngx_strlen("content-type: ");
-            content_type.len = (line_end - 1) - content_type.data;
+    ctx->body_streaming = COLLECTION_NONE;
+    ctx->scratch_pool = r->pool;
+    ctx->request_body = NULL;
+    ctx->response_body = NULL;
 
-            tmp = ngx_array_push(&ctx->content_type);
-            if (tmp == NULL)
-                return NGX_ERROR;
+    /* nothing of the rules outlives the window */
+    ngx_reset_pool(ctx->stream_pool);
 
-            ngx_memcpy(tmp, &content_type, sizeof(ngx_str_t));
-        }
+    keep = ngx_min(window->len, cf->body_streaming_window);
 
-        idx += (u_char*)line_end - (full_body->data + idx) + 1;
-        if (full_body->data[idx] != '\r' || full_body->data[idx+1] != '\n') {
-            ctx->process_body_error = 1;
-            ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_FORMAT");
-            return NGX_ERROR;
-        }
+    ngx_memmove(window->data, window->data + window->len - keep, keep);
+    window->len = keep;
+    *kept = keep;
 
-        idx += 2;
-        body_end = NULL;
-
-        while (idx < full_body->len) {
-            body_end = (u_char*) ngx_strstr(full_body->data+idx, "\r\n--");
-            while(!body_end) {
-                idx += ngx_strlen((const char*)full_body->data+idx);
-                if (idx < full_body->len-2) {
-                    idx++;
-                    body_end = (u_char*) ngx_strstr(full_body->data+idx, "\r\n--");
-                } else
-                    break;
-            }
+    return rc;
+}
 
-            if (!body_end) {
-                ctx->process_body_error = 1;
-                ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_FORMAT");
-                return NGX_ERROR;
-            }
+/*
+** @description: This function is called to add bytes to a window, the rules
+** run each time it is full.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_uint_t phase
+** @para: u_char *p
+** @para: u_char *last
+** @return: static ngx_int_t (NGX_DECLINED or the status of the rule)
+*/
 
-            if (!ngx_strncmp(body_end+4, boundary, boundary_len))
-                break;
-            else {
-                idx += (u_char*)body_end - (full_body->data + idx) + 1;
-                body_end = NULL;
-            }
-        }
+static ngx_int_t
+yy_sec_waf_stream_fill(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx,
+    ngx_uint_t phase, u_char *p, u_char *last)
+{
+    size_t      n, size;
+    ngx_int_t   rc;
+    ngx_str_t  *window;
 
-        if (!body_end) {
-            return NGX_ERROR;
-        }
+    if (phase == REQUEST_BODY_PHASE) {
+        window = &ctx->body_window;
+        size = ctx->body_window_size;
 
-        if (filename.data) {
-            nullbytes = ngx_yy_sec_waf_unescape(&filename);
-            if (nullbytes > 0) {
-                ctx->process_body_error = 1;
-                ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_HEX_ENCODING");
-                return NGX_ERROR;
-            }
+    } else {
+        window = &ctx->response_window;
+        size = ctx->response_window_size;
+    }
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "[ysec_waf] checking filename [%V]", &filename);
-
-            if (content_type.data) {
-                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                    "[ysec_waf] checking content_type [%V]", &content_type);
-
-                if (!ngx_strnstr(filename.data, ".html", filename.len)
-                    || !ngx_strnstr(filename.data, ".html", filename.len)) {
-                    if (!ngx_strncmp(content_type.data, "text/html", content_type.len)) {
-                        ctx->process_body_error = 1;
-                        ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_FILENAME");
-                        return NGX_ERROR;
-                    }
-                }
-                else if (!ngx_strnstr(filename.data, ".php", filename.len)
-                    || !ngx_strnstr(filename.data, ".jsp", filename.len)) {
-                    if (!ngx_strncmp(content_type.data, "application/octet-stream", content_type.len)) {
-                        ctx->process_body_error = 1;
-                        ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_FILENAME");
-                        return NGX_ERROR;
-                    }
-                }
-            }
+    while (p < last) {
+        n = ngx_min((size_t) (last - p), size - window->len);
 
-            idx += (u_char*)body_end - (full_body->data + idx);
-        } else if (name.data) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "[ysec_waf] checking name [%V]", &name);
+        ngx_memcpy(window->data + window->len, p, n);
+        ctx->copy_bytes += n;
+        window->len += n;
+        p += n;
 
-            idx += (u_char*)body_end - (full_body->data + idx);
+        if (window->len < size) {
+            continue;
         }
 
-        if (!ngx_strncmp(body_end, "\r\n", ngx_strlen("\r\n")))
-            idx += ngx_strlen("\r\n");
+        rc = yy_sec_waf_stream_window(r, cf, ctx, phase);
+        if (rc != NGX_DECLINED || ctx->process_done) {
+            return rc;
+        }
     }
 
-    return NGX_OK;
+    return NGX_DECLINED;
 }
 
 /*
-** @description: This function is called to process the body of the request.
+** @description: This function is called to pass bytes of the body, as sent
+** or inflated, to the body processors and the window.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
 ** @para: ngx_http_request_ctx_t *ctx
-** @return: NGX_OK or NGX_ERROR if failed.
+** @para: u_char *p
+** @para: u_char *last
+** @return: static ngx_int_t (NGX_DECLINED, NGX_ERROR or the status of the rule)
 */
 
-ngx_int_t
-ngx_http_yy_sec_waf_process_body(ngx_http_request_t *r,
-    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx)
+static ngx_int_t
+yy_sec_waf_stream_bytes(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx,
+    u_char *p, u_char *last)
 {
-    u_char      *src;
-    ngx_chain_t *bb;
-    ngx_str_t   *full_body;
+    if (ctx->multipart) {
+        (void) ngx_http_yy_sec_waf_multipart_feed(r, ctx, p, last - p);
 
-    if (!r->request_body->bufs || !r->headers_in.content_type) {
-        ctx->process_body_error = 1;
-        ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_CONTENT_TYPE");
+    } else if (ctx->json) {
+        (void) ngx_http_yy_sec_waf_json_feed(r, ctx, p, last - p);
+
+    } else if (ctx->stream_form
+               && yy_sec_waf_stream_form(r, cf, ctx, p, last - p) != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
-    if (r->request_body->temp_file) {
-        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] post body is stored in temp_file.");
-        return NGX_OK;
-    }
+    return yy_sec_waf_stream_fill(r, cf, ctx, REQUEST_BODY_PHASE, p, last);
+}
 
-    full_body = ngx_palloc(r->pool, sizeof(ngx_str_t));
-    if (full_body == NULL) {
-        return NGX_ERROR;
+/*
+** @description: This function is called to pass the next bytes of the body,
+** inflated first if it is compressed.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: u_char *last
+** @return: static ngx_int_t (NGX_DECLINED, NGX_ERROR or the status of the rule)
+*/
+
+static ngx_int_t
+yy_sec_waf_stream_input(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx,
+    u_char *p, u_char *last)
+{
+    ngx_int_t  rc;
+    ngx_str_t  out;
+
+    if (ctx->inflate == NULL) {
+        return yy_sec_waf_stream_bytes(r, cf, ctx, p, last);
     }
 
-    if (r->request_body->bufs->next == NULL) {
-        full_body->len = (ngx_uint_t) (r->request_body->bufs->buf->last
-            - r->request_body->bufs->buf->pos);
+    ngx_http_yy_sec_waf_inflate_input(ctx, p, last - p);
 
-        full_body->data = ngx_pcalloc(r->pool, full_body->len+1);
+    while (ngx_http_yy_sec_waf_inflate_output(r, ctx, &out) == NGX_AGAIN) {
+        rc = yy_sec_waf_stream_bytes(r, cf, ctx, out.data, out.data + out.len);
+        if (rc != NGX_DECLINED || ctx->process_done) {
+            return rc;
+        }
+    }
 
-        ngx_memcpy(full_body->data, r->request_body->bufs->buf->pos, full_body->len);
-    } else {
-        for (full_body->len = 0, bb = r->request_body->bufs; bb; bb = bb->next)
-            full_body->len += bb->buf->last - bb->buf->pos;
+    return NGX_DECLINED;
+}
 
-        full_body->data = ngx_pcalloc(r->pool, full_body->len+1);
+/*
+** @description: This function is called at the end of the body, to finish
+** the body processors and inspect what is left in the window.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @para: ngx_http_request_ctx_t *ctx
+** @return: static ngx_int_t (NGX_DECLINED or the status of the rule)
+*/
 
-        if (full_body->data == NULL)
-            return NGX_ERROR;
+static ngx_int_t
+yy_sec_waf_stream_end(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx)
+{
+    if (ctx->inflate) {
+        (void) ngx_http_yy_sec_waf_inflate_finish(r, ctx);
+    }
 
-        src = full_body->data;
+    if (ctx->multipart) {
+        (void) ngx_http_yy_sec_waf_multipart_finish(r, ctx);
 
-        for (bb = r->request_body->bufs; bb; bb = bb->next)
-            full_body->data = ngx_cpymem(full_body->data, bb->buf->pos,
-                bb->buf->last - bb->buf->pos);
+    } else if (ctx->json) {
+        (void) ngx_http_yy_sec_waf_json_finish(r, ctx);
 
-        full_body->data = src;
+    } else if (ctx->stream_form && ctx->form_body.len) {
+        ctx->full_body = &ctx->form_body;
+        ngx_http_yy_sec_waf_process_spliturl(r, &ctx->form_body, ctx,
+                                             PROCESS_ARGS_POST);
     }
 
-    //ngx_yy_sec_waf_unescape(full_body);
+    /* the rest, unless all of it was seen with the previous window */
+    if (ctx->body_window.len > ctx->body_window_kept) {
+        return yy_sec_waf_stream_window(r, cf, ctx, REQUEST_BODY_PHASE);
+    }
 
-    if (!ngx_strncasecmp(r->headers_in.content_type->value.data,
-        (u_char*)"multipart/form-data", ngx_strlen("multipart/form-data"))) {
-        /* MULTIPART */
-        ngx_http_yy_sec_waf_process_multipart(r, full_body, ctx);
-    } else if (!ngx_strncasecmp(r->headers_in.content_type->value.data,
-        (u_char*)"application/x-www-form-urlencoded", ngx_strlen("application/x-www-form-urlencoded"))) {
-        /* X-WWW-FORM-URLENCODED */
-        ctx->full_body = full_body;
+    return NGX_DECLINED;
+}
 
-        u_char *buf = full_body->data;
-        ngx_uint_t len = full_body->len;
+/*
+** @description: This function is called to inspect the buffers of the body
+** as they are read. The REQUEST_BODY rules run each time the window is full
+** and at the end of the body, so a match shorter than body_streaming_window
+** is found even if it spans two buffers.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_chain_t *in
+** @return: NGX_DECLINED, NGX_ERROR or the status of the rule matched.
+*/
 
-        // Convert \r \n into space.
-        while (len-- > 0) {
-            if (*buf == '\r' || *buf == '\n') {
-                *buf = ' ';
+ngx_int_t
+ngx_http_yy_sec_waf_stream_body(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx,
+    ngx_chain_t *in)
+{
+    ngx_int_t           rc;
+    ngx_chain_t        *cl;
+
+    if (ctx->body_window.data == NULL) {
+        if (yy_sec_waf_stream_init(r, cf, ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (cf->body_inflate
+            && ngx_http_yy_sec_waf_inflate_init(r, cf, ctx) == NGX_ERROR)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    for (cl = in; cl; cl = cl->next) {
+
+        if (ngx_buf_in_memory(cl->buf)) {
+            rc = yy_sec_waf_stream_input(r, cf, ctx, cl->buf->pos,
+                                         cl->buf->last);
+            if (rc != NGX_DECLINED || ctx->process_done) {
+                return rc;
             }
+        }
 
-            buf++;
+        if (cl->buf->last_buf) {
+            rc = yy_sec_waf_stream_end(r, cf, ctx);
+            if (rc != NGX_DECLINED || ctx->process_done) {
+                return rc;
+            }
         }
-        
-        ngx_http_yy_sec_waf_process_spliturl(r, full_body, ctx, PROCESS_ARGS_POST);
     }
 
-    return NGX_OK;
+    return NGX_DECLINED;
 }
 
+/*
+** @description: This function is called to inspect the buffers of the
+** response as they are sent, the way the request body is streamed. Only the
+** first response_body_limit bytes are inspected, and buffers in a file are
+** let through.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_chain_t *in
+** @return: NGX_DECLINED, NGX_ERROR or the status of the rule matched.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_stream_response(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx,
+    ngx_chain_t *in)
+{
+    u_char       *p, *last;
+    ngx_int_t     rc;
+    ngx_chain_t  *cl;
+    ngx_flag_t    end;
+
+    if (ctx->response_window.data == NULL) {
+        ctx->response_window_size = cf->body_streaming_window
+                                    + YY_SEC_WAF_STREAM_SLICE;
+
+        ctx->response_window.data = ngx_pnalloc(r->pool,
+                                                ctx->response_window_size);
+        if (ctx->response_window.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->alloc_bytes += ctx->response_window_size;
+
+        if (yy_sec_waf_stream_pool(r, ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    for (cl = in; cl; cl = cl->next) {
+
+        if (cf->response_body_limit
+            && ctx->response_inspected >= cf->response_body_limit)
+        {
+            break;
+        }
+
+        end = cl->buf->last_buf;
+
+        if (ngx_buf_in_memory(cl->buf)) {
+            p = cl->buf->pos;
+            last = cl->buf->last;
+
+            if (cf->response_body_limit
+                && (size_t) (last - p)
+                   >= cf->response_body_limit - ctx->response_inspected)
+            {
+                last = p + (cf->response_body_limit - ctx->response_inspected);
+                end = 1;
+            }
 
+            ctx->response_inspected += last - p;
+
+            rc = yy_sec_waf_stream_fill(r, cf, ctx, RESPONSE_BODY_PHASE,
+                                        p, last);
+            if (rc != NGX_DECLINED || ctx->process_done) {
+                return rc;
+            }
+        }
+
+        /* the rest, unless all of it was seen with the previous window */
+        if (end && ctx->response_window.len > ctx->response_window_kept) {
+            rc = yy_sec_waf_stream_window(r, cf, ctx, RESPONSE_BODY_PHASE);
+            if (rc != NGX_DECLINED || ctx->process_done) {
+                return rc;
+            }
+        }
+    }
+
+    return NGX_DECLINED;
+}
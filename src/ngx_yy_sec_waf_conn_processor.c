@@ -1,5 +1,7 @@
 #include "ngx_yy_sec_waf.h"
 
+#include <ngx_md5.h>
+
 typedef struct {
     u_char              color;
     u_char              len;
@@ -8,16 +10,47 @@ typedef struct {
 } yy_sec_waf_conn_node_t;
 
 
+/* a slot of the table, never emptied, reused once its counter is back to 0 */
+#define YY_SEC_WAF_CONN_EMPTY    0
+#define YY_SEC_WAF_CONN_WRITING  1
+#define YY_SEC_WAF_CONN_READY    2
+
+/* slots probed from the hash of a key before the table is full */
+#define YY_SEC_WAF_CONN_PROBES   64
+
+/* up to 16 bytes as they are, a longer key is its md5 tagged with a 17th */
+#define YY_SEC_WAF_CONN_KEY      17
+
+/* how far ahead of its rate a key may get, in microseconds */
+#define YY_SEC_WAF_RATE_AHEAD    60000000
+
+typedef struct {
+    ngx_atomic_t        state;
+    ngx_atomic_t        conn;
+    /* GCRA, the theoretical arrival time of the next request in usec */
+    ngx_atomic_t        tat;
+    u_char              len;
+    u_char              key[YY_SEC_WAF_CONN_KEY];
+} yy_sec_waf_conn_slot_t;
+
+
+typedef struct {
+    ngx_uint_t              mask;
+    yy_sec_waf_conn_slot_t  slots[1];
+} yy_sec_waf_conn_table_t;
+
+
 typedef struct {
-    ngx_shm_zone_t     *shm_zone;
-    ngx_rbtree_node_t  *node;
+    ngx_shm_zone_t          *shm_zone;
+    ngx_rbtree_node_t       *node;
+    yy_sec_waf_conn_slot_t  *slot;
 } yy_sec_waf_conn_cleanup_t;
 
 
 typedef struct {
-    ngx_rbtree_t       *rbtree;
-    ngx_int_t           index;
-    ngx_str_t           var;
+    ngx_rbtree_t               *rbtree;
+    yy_sec_waf_conn_table_t    *table;
+    ngx_http_yy_sec_waf_zone_t *zone;
 } yy_sec_waf_conn_ctx_t;
 
 /*
@@ -36,6 +69,11 @@ yy_sec_waf_conn_cleanup(void *data)
     yy_sec_waf_conn_ctx_t   *ctx;
     yy_sec_waf_conn_node_t  *lc;
 
+    if (lccln->slot != NULL) {
+        ngx_atomic_fetch_add(&lccln->slot->conn, -1);
+        return;
+    }
+
     ctx = lccln->shm_zone->data;
     shpool = (ngx_slab_pool_t *) lccln->shm_zone->shm.addr;
     node = lccln->node;
@@ -138,6 +176,7 @@ yy_sec_waf_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     yy_sec_waf_conn_ctx_t  *octx = data;
 
     size_t                      len;
+    ngx_uint_t                  n;
     ngx_slab_pool_t            *shpool;
     ngx_rbtree_node_t          *sentinel;
     yy_sec_waf_conn_ctx_t      *ctx;
@@ -145,7 +184,20 @@ yy_sec_waf_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     ctx = shm_zone->data;
 
     if (octx) {
+        if (ctx->zone->key_text.len != octx->zone->key_text.len
+            || ngx_strncmp(ctx->zone->key_text.data, octx->zone->key_text.data,
+                           ctx->zone->key_text.len) != 0)
+        {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "[ysec_waf] yy_sec_waf_zone \"%V\" uses the \"%V\" key "
+                          "while previously it used the \"%V\" key",
+                          &ctx->zone->name, &ctx->zone->key_text,
+                          &octx->zone->key_text);
+            return NGX_ERROR;
+        }
+
         ctx->rbtree = octx->rbtree;
+        ctx->table = octx->table;
 
         return NGX_OK;
     }
@@ -153,11 +205,41 @@ yy_sec_waf_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
     if (shm_zone->shm.exists) {
-        ctx->rbtree = shpool->data;
+        if (ctx->zone->rbtree) {
+            ctx->rbtree = shpool->data;
+
+        } else {
+            ctx->table = shpool->data;
+        }
 
         return NGX_OK;
     }
 
+    if (!ctx->zone->rbtree) {
+
+        /* half of the zone, the rest is left to the slab allocator */
+        for (n = 1;
+             (n << 1) * sizeof(yy_sec_waf_conn_slot_t)
+             <= shm_zone->shm.size / 2;
+             n <<= 1)
+        { /* void */ }
+
+        ctx->table = ngx_slab_alloc(shpool,
+                                    offsetof(yy_sec_waf_conn_table_t, slots)
+                                    + n * sizeof(yy_sec_waf_conn_slot_t));
+        if (ctx->table == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* slab pages are not zeroed */
+        ngx_memzero(ctx->table->slots, n * sizeof(yy_sec_waf_conn_slot_t));
+        ctx->table->mask = n - 1;
+
+        shpool->data = ctx->table;
+
+        goto log_ctx;
+    }
+
     ctx->rbtree = ngx_slab_alloc(shpool, sizeof(ngx_rbtree_t));
     if (ctx->rbtree == NULL) {
         return NGX_ERROR;
@@ -173,6 +255,8 @@ yy_sec_waf_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     ngx_rbtree_init(ctx->rbtree, sentinel,
                     yy_sec_waf_conn_rbtree_insert_value);
 
+log_ctx:
+
     len = sizeof("[ysec_waf] in yy_sec_waf_conn_zone \"\"") + shm_zone->shm.name.len;
 
     shpool->log_ctx = ngx_slab_alloc(shpool, len);
@@ -189,13 +273,14 @@ yy_sec_waf_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 /*
 ** @description: This function is called to lookup conn node.
 ** @para: ngx_rbtree_t *rbtree
-** @para: ngx_http_variable_value_t *vv
+** @para: u_char *key
+** @para: size_t len
 ** @para: uint32_t hash
 ** @return: static ngx_rbtree_node_t *.
 */
 
 static ngx_rbtree_node_t *
-yy_sec_waf_conn_lookup(ngx_rbtree_t *rbtree, ngx_http_variable_value_t *vv,
+yy_sec_waf_conn_lookup(ngx_rbtree_t *rbtree, u_char *key, size_t len,
     uint32_t hash)
 {
     ngx_int_t                    rc;
@@ -221,8 +306,7 @@ yy_sec_waf_conn_lookup(ngx_rbtree_t *rbtree, ngx_http_variable_value_t *vv,
 
         lcn = (yy_sec_waf_conn_node_t *) &node->color;
 
-        rc = ngx_memn2cmp(vv->data, lcn->data,
-                          (size_t) vv->len, (size_t) lcn->len);
+        rc = ngx_memn2cmp(key, lcn->data, len, (size_t) lcn->len);
         if (rc == 0) {
             return node;
         }
@@ -234,112 +318,355 @@ yy_sec_waf_conn_lookup(ngx_rbtree_t *rbtree, ngx_http_variable_value_t *vv,
 }
 
 /*
-** @description: This function is called to create shm zone.
-** @para: ngx_conf_t *cf
-** @return: ngx_shm_zone_t *.
+** @description: This function is called to find the first slot holding a
+** key, and count a connection in it.
+** @para: yy_sec_waf_conn_table_t *table
+** @para: u_char *key
+** @para: size_t len
+** @para: uint32_t hash
+** @return: static yy_sec_waf_conn_slot_t * or NULL if not found.
 */
 
-ngx_shm_zone_t *
-ngx_http_yy_sec_waf_create_shm_zone(ngx_conf_t *cf)
+static yy_sec_waf_conn_slot_t *
+yy_sec_waf_conn_hash_get(yy_sec_waf_conn_table_t *table, u_char *key,
+    size_t len, uint32_t hash)
 {
-    ssize_t                     n;
-    ngx_str_t                   value, name;
-    ngx_shm_zone_t             *shm_zone;
-    yy_sec_waf_conn_ctx_t      *ctx;
+    ngx_uint_t               n;
+    yy_sec_waf_conn_slot_t  *slot;
 
+    for (n = 0; n < YY_SEC_WAF_CONN_PROBES && n <= table->mask; n++) {
+        slot = &table->slots[(hash + n) & table->mask];
 
-    ctx = ngx_pcalloc(cf->pool, sizeof(yy_sec_waf_conn_ctx_t));
-    if (ctx == NULL) {
-        return NULL;
+        if (slot->state == YY_SEC_WAF_CONN_EMPTY) {
+            return NULL;
+        }
+
+        if (slot->state != YY_SEC_WAF_CONN_READY
+            || slot->len != len
+            || ngx_memcmp(slot->key, key, len) != 0)
+        {
+            continue;
+        }
+
+        /*
+         * Counted first, then checked again: a slot is only reused while
+         * its counter is 0, so it cannot change hands under the counter.
+         */
+
+        ngx_atomic_fetch_add(&slot->conn, 1);
+
+        if (slot->state == YY_SEC_WAF_CONN_READY
+            && slot->len == len
+            && ngx_memcmp(slot->key, key, len) == 0)
+        {
+            return slot;
+        }
+
+        ngx_atomic_fetch_add(&slot->conn, -1);
     }
 
-    ngx_str_set(&name, "yy_sec_waf_conn");
-    ngx_str_set(&value, "10m");
-    ngx_str_set(&ctx->var, "binary_remote_addr");
+    return NULL;
+}
 
-    ctx->index = ngx_http_get_variable_index(cf, &ctx->var);
-    if (ctx->index == NGX_ERROR) {
-        return NGX_CONF_ERROR;
+/*
+** @description: This function is called to count a connection of a key in
+** the table, without a lock or an allocation.
+** @para: yy_sec_waf_conn_table_t *table
+** @para: u_char *key
+** @para: size_t len
+** @para: ngx_atomic_uint_t now
+** @para: ngx_flag_t rated
+** @return: static yy_sec_waf_conn_slot_t * or NULL if the table is full.
+*/
+
+static yy_sec_waf_conn_slot_t *
+yy_sec_waf_conn_hash_acquire(yy_sec_waf_conn_table_t *table, u_char *key,
+    size_t len, ngx_atomic_uint_t now, ngx_flag_t rated)
+{
+    uint32_t                 hash;
+    ngx_uint_t               n;
+    ngx_atomic_uint_t        state;
+    yy_sec_waf_conn_slot_t  *slot, *first;
+
+    hash = ngx_crc32_short(key, len);
+
+    slot = yy_sec_waf_conn_hash_get(table, key, len, hash);
+    if (slot != NULL) {
+        return slot;
     }
 
-    n = ngx_parse_size(&value);
+    for (n = 0; n < YY_SEC_WAF_CONN_PROBES && n <= table->mask; n++) {
+        slot = &table->slots[(hash + n) & table->mask];
+        state = slot->state;
 
-    if (n == NGX_ERROR) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "[ysec_waf] invalid size of shm_zone \"%V\"", &value);
-        return NULL;
+        if (state == YY_SEC_WAF_CONN_EMPTY) {
+            if (ngx_atomic_cmp_set(&slot->state, YY_SEC_WAF_CONN_EMPTY,
+                                   YY_SEC_WAF_CONN_WRITING))
+            {
+                goto claimed;
+            }
+
+            /* taken meanwhile, it may be free again once written */
+            n--;
+            continue;
+        }
+
+        /* an idle key is kept until its rate has nothing more to tell */
+        if (state == YY_SEC_WAF_CONN_READY && slot->conn == 0
+            && (!rated || (ngx_atomic_int_t) (slot->tat - now) <= 0)
+            && ngx_atomic_cmp_set(&slot->state, YY_SEC_WAF_CONN_READY,
+                                  YY_SEC_WAF_CONN_WRITING))
+        {
+            if (slot->conn == 0) {
+                goto claimed;
+            }
+
+            /* counted by a reader meanwhile, left to its key */
+            ngx_memory_barrier();
+            slot->state = YY_SEC_WAF_CONN_READY;
+        }
     }
 
-    if (n < (ssize_t) (8 * ngx_pagesize)) {
-		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-						   "[ysec_waf] shm_zone \"%V\" is too small", &value);
-		return NGX_CONF_ERROR;
-	}
+    return NULL;
 
-    shm_zone = ngx_shared_memory_add(cf, &name, n,
-                                     &ngx_http_yy_sec_waf_module);
-    if (shm_zone == NULL) {
-        return NULL;
+claimed:
+
+    slot->len = (u_char) len;
+    ngx_memcpy(slot->key, key, len);
+    slot->tat = now;
+
+    ngx_atomic_fetch_add(&slot->conn, 1);
+
+    ngx_memory_barrier();
+    slot->state = YY_SEC_WAF_CONN_READY;
+
+    /*
+     * Two workers may have written the same new key in two slots. Each
+     * moves to the first one it finds ready, but a slot still being
+     * written is skipped, so both may stay in use: the connections and the
+     * rate of the key are split between them until one drains. Lookups
+     * find the slot probed first, so the other only loses connections.
+     */
+
+    first = yy_sec_waf_conn_hash_get(table, key, len, hash);
+
+    if (first != NULL) {
+        ngx_atomic_fetch_add(&slot->conn, -1);
+        return first;
     }
 
-    if (shm_zone->data) {
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
-                        "[ysec_waf] shm_zone \"%V\" is already bound to variable \"%Vs\"",
-                        &name, &ctx->var);
-        ngx_pfree(cf->cycle->shared_memory.pool, shm_zone);
-        return NULL;
+    return slot;
+}
+
+/*
+** @description: This function is called to account a request in the GCRA
+** state of its key.
+** @para: ngx_atomic_t *tat
+** @para: ngx_atomic_uint_t now
+** @para: ngx_uint_t interval
+** @return: static ngx_uint_t (the requests sent ahead of the rate, 0 while
+** within it)
+*/
+
+static ngx_uint_t
+yy_sec_waf_conn_gcra(ngx_atomic_t *tat, ngx_atomic_uint_t now,
+    ngx_uint_t interval)
+{
+    ngx_atomic_uint_t  old, next, ahead;
+
+    do {
+        old = *tat;
+
+        /* an idle key starts again from now, it gets no credit */
+        next = ((ngx_atomic_int_t) (old - now) > 0 ? old : now) + interval;
+        ahead = next - now;
+
+        if (ahead > YY_SEC_WAF_RATE_AHEAD + interval) {
+            ahead = YY_SEC_WAF_RATE_AHEAD + interval;
+            next = now + ahead;
+        }
+
+    } while (!ngx_atomic_cmp_set(tat, old, next));
+
+    return ahead / interval - 1;
+}
+
+/*
+** @description: This function is called to get the client address as a
+** key, masked to a prefix so a whole network is one key.
+** @para: ngx_http_request_t *r
+** @para: ngx_uint_t ipv4_prefix
+** @para: ngx_uint_t ipv6_prefix
+** @para: u_char *key (16 bytes)
+** @para: size_t *len
+** @return: NGX_OK or NGX_DECLINED if not an inet address.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_addr_key(ngx_http_request_t *r, ngx_uint_t ipv4_prefix,
+    ngx_uint_t ipv6_prefix, u_char *key, size_t *len)
+{
+    ngx_uint_t            bits, n;
+    struct sockaddr_in   *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6  *sin6;
+#endif
+
+    switch (r->connection->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) r->connection->sockaddr;
+
+        /* an IPv4 client of a dual stack socket is keyed as IPv4 */
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            ngx_memcpy(key, &sin6->sin6_addr.s6_addr[12], 4);
+            *len = 4;
+            bits = ipv4_prefix;
+            break;
+        }
+
+        ngx_memcpy(key, sin6->sin6_addr.s6_addr, 16);
+        *len = 16;
+        bits = ipv6_prefix;
+        break;
+#endif
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) r->connection->sockaddr;
+        ngx_memcpy(key, &sin->sin_addr.s_addr, 4);
+        *len = 4;
+        bits = ipv4_prefix;
+        break;
+
+    default:
+        return NGX_DECLINED;
     }
 
-    shm_zone->init = yy_sec_waf_conn_init_zone;
-    shm_zone->data = ctx;
+    n = bits / 8;
+
+    if (n < *len) {
+        key[n] &= (u_char) (0xff << (8 - bits % 8));
+        ngx_memzero(key + n + 1, *len - n - 1);
+    }
 
-    return shm_zone;
+    return NGX_OK;
 }
 
 /*
-** @description: This function is called to process connection counter.
+** @description: This function is called to get the key of a request in a
+** zone, the client address masked to its prefix or the key evaluated.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_zone_t *zone
+** @para: u_char *key
+** @para: size_t *len
+** @return: static ngx_int_t (NGX_OK, NGX_DECLINED if none or NGX_ERROR)
+*/
+
+static ngx_int_t
+yy_sec_waf_conn_key(ngx_http_request_t *r, ngx_http_yy_sec_waf_zone_t *zone,
+    u_char *key, size_t *len)
+{
+    ngx_str_t             value;
+    ngx_md5_t             md5;
+
+    if (zone->addr) {
+        return ngx_http_yy_sec_waf_addr_key(r, zone->ipv4_prefix,
+                                            zone->ipv6_prefix, key, len);
+    }
+
+    if (ngx_http_complex_value(r, &zone->key, &value) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (value.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    if (value.len < YY_SEC_WAF_CONN_KEY) {
+        ngx_memcpy(key, value.data, value.len);
+        *len = value.len;
+        return NGX_OK;
+    }
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, value.data, value.len);
+    ngx_md5_final(key, &md5);
+
+    key[16] = 0xff;
+    *len = YY_SEC_WAF_CONN_KEY;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to count the request in a zone.
 ** @para: ngx_http_request_ctx_t *ctx
-** @return: ngx_int_t.
+** @para: ngx_http_yy_sec_waf_zone_t *zone
+** @return: static ngx_int_t (NGX_OK, NGX_HTTP_SERVICE_UNAVAILABLE if the
+** zone is full or NGX_ERROR)
 */
 
-ngx_int_t
-ngx_http_yy_sec_waf_process_conn(ngx_http_request_ctx_t *ctx)
+static ngx_int_t
+yy_sec_waf_conn_count(ngx_http_request_ctx_t *ctx,
+    ngx_http_yy_sec_waf_zone_t *zone)
 {
+    u_char                          key[YY_SEC_WAF_CONN_KEY];
     size_t                          len, n;
     uint32_t                        hash;
+    ngx_atomic_uint_t               now;
+    ngx_int_t                       rc;
     ngx_slab_pool_t                *shpool;
     ngx_rbtree_node_t              *node;
     ngx_pool_cleanup_t             *cln;
-    ngx_http_variable_value_t      *vv;
     yy_sec_waf_conn_ctx_t          *conn_ctx;
     yy_sec_waf_conn_node_t         *lc;
+    yy_sec_waf_conn_slot_t         *slot;
     yy_sec_waf_conn_cleanup_t      *lccln;
 
-
-    if (ctx == NULL || ctx->cf == NULL
-        || ctx->cf->shm_zone == NULL
-        || ctx->cf->shm_zone->data == NULL) {
-        ngx_log_error(NGX_LOG_ERR, ctx->r->connection->log, 0, "[ysec_waf] NULL pointer");
-        return NGX_ERROR;
+    rc = yy_sec_waf_conn_key(ctx->r, zone, key, &len);
+    if (rc != NGX_OK) {
+        return rc == NGX_DECLINED ? NGX_OK : NGX_ERROR;
     }
 
-    conn_ctx = ctx->cf->shm_zone->data;
+    conn_ctx = zone->shm_zone->data;
+
+    node = NULL;
+    slot = NULL;
+
+    if (!zone->rbtree) {
+
+        now = (ngx_atomic_uint_t) ngx_current_msec * 1000;
+
+        slot = yy_sec_waf_conn_hash_acquire(conn_ctx->table, key, len, now,
+                                            zone->interval != 0);
+
+        if (slot == NULL) {
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+
+        ctx->conn[zone->index] = slot->conn;
+
+        /* the rate in the same slot, one lookup for both */
+        if (zone->interval) {
+            ctx->rate[zone->index] = yy_sec_waf_conn_gcra(&slot->tat, now,
+                                                          zone->interval);
+        }
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->r->connection->log, 0,
+                       "[ysec_waf] conn: %V %uA, rate: %ui", &zone->name,
+                       slot->conn, ctx->rate[zone->index]);
 
-	vv = ngx_http_get_indexed_variable(ctx->r, conn_ctx->index);
-	
-	if (vv == NULL || vv->not_found) {
-		return NGX_ERROR;
-	}
-	
-	len = vv->len;
+        goto cleanup;
+    }
 
-    hash = ngx_crc32_short(vv->data, vv->len);
+    hash = ngx_crc32_short(key, len);
 
-    shpool = (ngx_slab_pool_t *) ctx->cf->shm_zone->shm.addr;
+    shpool = (ngx_slab_pool_t *) zone->shm_zone->shm.addr;
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    node = yy_sec_waf_conn_lookup(conn_ctx->rbtree, vv, hash);
+    node = yy_sec_waf_conn_lookup(conn_ctx->rbtree, key, len, hash);
 
     if (node == NULL) {
 
@@ -351,7 +678,6 @@ ngx_http_yy_sec_waf_process_conn(ngx_http_request_ctx_t *ctx)
 
         if (node == NULL) {
             ngx_shmtx_unlock(&shpool->mutex);
-            yy_sec_waf_conn_cleanup_all(ctx->pool);
             return NGX_HTTP_SERVICE_UNAVAILABLE;
         }
 
@@ -360,7 +686,7 @@ ngx_http_yy_sec_waf_process_conn(ngx_http_request_ctx_t *ctx)
         node->key = hash;
         lc->len = (u_char) len;
         lc->conn = 1;
-        ngx_memcpy(lc->data, vv->data, len);
+        ngx_memcpy(lc->data, key, len);
 
         ngx_rbtree_insert(conn_ctx->rbtree, node);
 
@@ -371,14 +697,16 @@ ngx_http_yy_sec_waf_process_conn(ngx_http_request_ctx_t *ctx)
         lc->conn++;
     }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->r->connection->log, 0,
-                   "[ysec_waf] conn: %08XD %d", node->key, lc->conn);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->r->connection->log, 0,
+                   "[ysec_waf] conn: %V %08XD %d", &zone->name, node->key,
+                   lc->conn);
 
-    // GET the connection counter.
-    ctx->conn_per_ip = lc->conn;
+    ctx->conn[zone->index] = lc->conn;
 
     ngx_shmtx_unlock(&shpool->mutex);
 
+cleanup:
+
     cln = ngx_pool_cleanup_add(ctx->pool,
                                sizeof(yy_sec_waf_conn_cleanup_t));
     if (cln == NULL) {
@@ -388,10 +716,495 @@ ngx_http_yy_sec_waf_process_conn(ngx_http_request_ctx_t *ctx)
     cln->handler = yy_sec_waf_conn_cleanup;
     lccln = cln->data;
 
-    lccln->shm_zone = ctx->cf->shm_zone;
+    lccln->shm_zone = zone->shm_zone;
     lccln->node = node;
+    lccln->slot = slot;
 
     return NGX_OK;
 }
 
+/*
+** @description: This function is called to process connection counter,
+** the request is counted in every zone.
+** @para: ngx_http_request_ctx_t *ctx
+** @return: ngx_int_t.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_process_conn(ngx_http_request_ctx_t *ctx)
+{
+    ngx_int_t                         rc;
+    ngx_uint_t                        i;
+    ngx_http_yy_sec_waf_zone_t      **zone;
+    ngx_http_yy_sec_waf_main_conf_t  *mcf;
+
+    mcf = ngx_http_get_module_main_conf(ctx->r, ngx_http_yy_sec_waf_module);
+
+    if (mcf->zones.nelts == 0) {
+        ngx_log_error(NGX_LOG_ERR, ctx->r->connection->log, 0,
+                      "[ysec_waf] no yy_sec_waf_zone");
+        return NGX_ERROR;
+    }
+
+    ctx->conn = ngx_pcalloc(ctx->pool,
+                            2 * mcf->zones.nelts * sizeof(ngx_uint_t));
+    if (ctx->conn == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->rate = ctx->conn + mcf->zones.nelts;
+
+    zone = mcf->zones.elts;
+
+    for (i = 0; i < mcf->zones.nelts; i++) {
+        rc = yy_sec_waf_conn_count(ctx, zone[i]);
+
+        if (rc != NGX_OK) {
+            yy_sec_waf_conn_cleanup_all(ctx->pool);
+            return rc;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to get the connections of the key
+** of the request in a zone, CONN_PER_IP or CONN_ and the name of the zone.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_variable_value_t *v
+** @para: uintptr_t data
+** @return: ngx_int_t.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_get_conn(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                    *p;
+    ngx_http_request_ctx_t    *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
+
+    if (ctx == NULL || ctx->conn == NULL || ctx->conn[data] == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_yy_sec_waf_uitoa(r->pool, ctx->conn[data]);
+
+    v->len = ngx_strlen(p);
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->escape = 0;
+    v->not_found = 0;
+    v->data = p;
 
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to get how many requests the key
+** of the request is ahead of the rate of a zone, REQ_RATE or REQ_RATE_ and
+** the name of the zone.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_variable_value_t *v
+** @para: uintptr_t data
+** @return: ngx_int_t.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_get_rate(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                           *p;
+    ngx_http_request_ctx_t           *ctx;
+    ngx_http_yy_sec_waf_zone_t      **zone;
+    ngx_http_yy_sec_waf_main_conf_t  *mcf;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_yy_sec_waf_module);
+
+    if (ctx == NULL || ctx->conn == NULL || data >= mcf->zones.nelts) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    zone = mcf->zones.elts;
+
+    /* 0 is a rate, only a zone which was not counted has none */
+    if (zone[data]->interval == 0 || zone[data]->rbtree
+        || ctx->conn[data] == 0)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_yy_sec_waf_uitoa(r->pool, ctx->rate[data]);
+
+    v->len = ngx_strlen(p);
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->escape = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to add a variable of a zone.
+** @para: ngx_conf_t *cf
+** @para: char *prefix
+** @para: ngx_http_yy_sec_waf_zone_t *zone
+** @para: ngx_http_get_variable_pt handler
+** @return: static ngx_http_variable_t * or NULL if failed.
+*/
+
+static ngx_http_variable_t *
+yy_sec_waf_conn_add_variable(ngx_conf_t *cf, char *prefix,
+    ngx_http_yy_sec_waf_zone_t *zone, ngx_http_get_variable_pt handler)
+{
+    ngx_str_t             name;
+    ngx_http_variable_t  *var;
+
+    name.len = ngx_strlen(prefix) + zone->name.len;
+    name.data = ngx_pnalloc(cf->pool, name.len);
+    if (name.data == NULL) {
+        return NULL;
+    }
+
+    ngx_sprintf(name.data, "%s%V", prefix, &zone->name);
+
+    var = ngx_http_add_variable(cf, &name, NGX_HTTP_VAR_CHANGEABLE);
+    if (var == NULL) {
+        return NULL;
+    }
+
+    var->get_handler = handler;
+    var->data = zone->index;
+
+    return var;
+}
+
+/*
+** @description: This function is called to add a zone, its shared memory
+** and its variable.
+** @para: ngx_conf_t *cf
+** @para: ngx_http_yy_sec_waf_main_conf_t *mcf
+** @para: ngx_http_yy_sec_waf_zone_t *zone
+** @para: ssize_t size
+** @return: static char *
+*/
+
+static char *
+yy_sec_waf_conn_add_zone(ngx_conf_t *cf, ngx_http_yy_sec_waf_main_conf_t *mcf,
+    ngx_http_yy_sec_waf_zone_t *zone, ssize_t size)
+{
+    u_char                       *p;
+    ngx_str_t                     name;
+    ngx_uint_t                    i;
+    ngx_http_variable_t          *var;
+    yy_sec_waf_conn_ctx_t        *ctx;
+    ngx_http_yy_sec_waf_zone_t  **zp;
+
+    zp = mcf->zones.elts;
+
+    for (i = 0; i < mcf->zones.nelts; i++) {
+        if (zp[i]->name.len == zone->name.len
+            && ngx_strncmp(zp[i]->name.data, zone->name.data,
+                           zone->name.len) == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "[ysec_waf] duplicate yy_sec_waf_zone \"%V\"",
+                               &zone->name);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[ysec_waf] yy_sec_waf_zone \"%V\" is too small",
+                           &zone->name);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(yy_sec_waf_conn_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->zone = zone;
+
+    /* a zone of its own, the layouts cannot follow each other on reload */
+    name.len = sizeof("yy_sec_waf_") - 1 + zone->name.len
+               + (zone->rbtree ? sizeof("_rbtree") - 1 : 0);
+    name.data = ngx_pnalloc(cf->pool, name.len);
+    if (name.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    p = ngx_sprintf(name.data, "yy_sec_waf_%V", &zone->name);
+
+    if (zone->rbtree) {
+        ngx_sprintf(p, "_rbtree");
+    }
+
+    zone->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                           &ngx_http_yy_sec_waf_module);
+    if (zone->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (zone->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[ysec_waf] shm_zone \"%V\" is already in use",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
+    zone->shm_zone->init = yy_sec_waf_conn_init_zone;
+    zone->shm_zone->data = ctx;
+
+    zp = ngx_array_push(&mcf->zones);
+    if (zp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    zone->index = mcf->zones.nelts - 1;
+    *zp = zone;
+
+    /* CONN_PER_IP is already there, for the first zone until named */
+    if (yy_sec_waf_conn_add_variable(cf, "CONN_", zone,
+                                     ngx_http_yy_sec_waf_get_conn)
+        == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (zone->interval == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (yy_sec_waf_conn_add_variable(cf, "REQ_RATE_", zone,
+                                     ngx_http_yy_sec_waf_get_rate)
+        == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    /* and REQ_RATE follows CONN_PER_IP */
+    if (zone->name.len == sizeof("PER_IP") - 1
+        && ngx_strncmp(zone->name.data, "PER_IP", zone->name.len) == 0)
+    {
+        ngx_str_set(&name, "REQ_RATE");
+
+        var = ngx_http_add_variable(cf, &name, NGX_HTTP_VAR_CHANGEABLE);
+        if (var == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        var->data = zone->index;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+** @description: This function is called to read yy_sec_waf_zone, as
+** name=NAME key=KEY [size=SIZE] [rate=Nr/s] [ipv4_prefix=N] [ipv6_prefix=N]
+** [rbtree].
+** @para: ngx_conf_t *cf
+** @para: ngx_command_t *cmd
+** @para: void *conf
+** @return: char *
+*/
+
+char *
+ngx_http_yy_sec_waf_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_yy_sec_waf_main_conf_t *mcf = conf;
+
+    u_char                            *p;
+    size_t                             len;
+    ssize_t                            size;
+    ngx_int_t                          n, scale;
+    ngx_str_t                         *value, s;
+    ngx_uint_t                         i, prefix;
+    ngx_http_yy_sec_waf_zone_t        *zone;
+    ngx_http_compile_complex_value_t   ccv;
+
+    value = cf->args->elts;
+
+    zone = ngx_pcalloc(cf->pool, sizeof(ngx_http_yy_sec_waf_zone_t));
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    size = 10 * 1024 * 1024;
+    prefix = 0;
+    zone->ipv4_prefix = 32;
+    zone->ipv6_prefix = 64;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "name=", 5) == 0) {
+            zone->name.data = value[i].data + 5;
+            zone->name.len = value[i].len - 5;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "key=", 4) == 0) {
+            zone->key_text.data = value[i].data + 4;
+            zone->key_text.len = value[i].len - 4;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+            len = value[i].len;
+            p = value[i].data + len - 3;
+
+            if (ngx_strncmp(p, "r/s", 3) == 0) {
+                scale = 1000000;
+                len -= 3;
+
+            } else if (ngx_strncmp(p, "r/m", 3) == 0) {
+                scale = 60000000;
+                len -= 3;
+
+            } else {
+                goto invalid;
+            }
+
+            n = ngx_atoi(value[i].data + 5, len - 5);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            zone->interval = ngx_max(scale / n, 1);
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ipv4_prefix=", 12) == 0) {
+            n = ngx_atoi(value[i].data + 12, value[i].len - 12);
+            if (n == NGX_ERROR || n < 1 || n > 32) {
+                goto invalid;
+            }
+
+            zone->ipv4_prefix = n;
+            prefix = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ipv6_prefix=", 12) == 0) {
+            n = ngx_atoi(value[i].data + 12, value[i].len - 12);
+            if (n == NGX_ERROR || n < 1 || n > 128) {
+                goto invalid;
+            }
+
+            zone->ipv6_prefix = n;
+            prefix = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "rbtree") == 0) {
+            zone->rbtree = 1;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (zone->name.len == 0 || zone->key_text.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[ysec_waf] yy_sec_waf_zone needs name= and key=");
+        return NGX_CONF_ERROR;
+    }
+
+    if (zone->rbtree && zone->interval) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[ysec_waf] yy_sec_waf_zone \"%V\": rate= is only "
+                           "kept in the table, not with rbtree", &zone->name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the address is read from the connection, so it can be masked */
+    if (zone->key_text.len == sizeof("$binary_remote_addr") - 1
+        && ngx_strncmp(zone->key_text.data, "$binary_remote_addr",
+                       zone->key_text.len) == 0)
+    {
+        zone->addr = 1;
+
+    } else {
+        if (prefix) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "[ysec_waf] yy_sec_waf_zone \"%V\": prefixes "
+                               "need key=$binary_remote_addr", &zone->name);
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &zone->key_text;
+        ccv.complex_value = &zone->key;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return yy_sec_waf_conn_add_zone(cf, mcf, zone, size);
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "[ysec_waf] invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+/*
+** @description: This function is called for conn_processor without any
+** yy_sec_waf_zone, to count per client address as before.
+** @para: ngx_conf_t *cf
+** @return: char *
+*/
+
+char *
+ngx_http_yy_sec_waf_default_zone(ngx_conf_t *cf)
+{
+    ngx_http_yy_sec_waf_zone_t       *zone;
+    ngx_http_yy_sec_waf_main_conf_t  *mcf;
+
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_yy_sec_waf_module);
+
+    if (mcf->zones.nelts) {
+        return NGX_CONF_OK;
+    }
+
+    zone = ngx_pcalloc(cf->pool, sizeof(ngx_http_yy_sec_waf_zone_t));
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_set(&zone->name, "PER_IP");
+    ngx_str_set(&zone->key_text, "$binary_remote_addr");
+    zone->addr = 1;
+    zone->ipv4_prefix = 32;
+    zone->ipv6_prefix = 64;
+
+    return yy_sec_waf_conn_add_zone(cf, mcf, zone, 10 * 1024 * 1024);
+}
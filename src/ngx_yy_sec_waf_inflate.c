@@ -0,0 +1,310 @@
+#include "ngx_yy_sec_waf.h"
+
+#include <zlib.h>
+
+/* inflated bytes handed to the body processors at a time */
+#define YY_SEC_WAF_INFLATE_BUFFER  8192
+
+struct ngx_http_yy_sec_waf_inflate_s {
+    z_stream    zstream;
+
+    u_char     *out;
+    size_t      limit;
+    ngx_uint_t  ratio;
+
+    /* the last call filled the buffer, zlib may hold more */
+    ngx_flag_t  more;
+    ngx_flag_t  done;
+    ngx_flag_t  failed;
+};
+
+/*
+** @description: This function is called to stop inflating a body which is
+** malformed or over the limits, the rest of it is not inspected.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: char *msg
+** @return: static ngx_int_t (NGX_ERROR)
+*/
+
+static ngx_int_t
+yy_sec_waf_inflate_error(ngx_http_request_ctx_t *ctx, char *msg)
+{
+    ctx->inflate->failed = 1;
+    ctx->process_body_error = 1;
+    ctx->process_body_error_msg.data = (u_char *) msg;
+    ctx->process_body_error_msg.len = ngx_strlen(msg);
+
+    return NGX_ERROR;
+}
+
+/*
+** @description: This function is called by zlib to allocate from the pool
+** of the request.
+** @para: void *opaque
+** @para: u_int items
+** @para: u_int size
+** @return: static void *
+*/
+
+static void *
+yy_sec_waf_inflate_alloc(void *opaque, u_int items, u_int size)
+{
+    ngx_http_request_ctx_t *ctx = opaque;
+
+    ctx->alloc_bytes += items * size;
+
+    return ngx_palloc(ctx->r->pool, items * size);
+}
+
+static void
+yy_sec_waf_inflate_free(void *opaque, void *address)
+{
+    /* freed with the pool */
+}
+
+/*
+** @description: This function is called to release zlib with the request.
+** @para: void *data
+** @return: static void
+*/
+
+static void
+yy_sec_waf_inflate_cleanup(void *data)
+{
+    ngx_http_yy_sec_waf_inflate_t  *zf = data;
+
+    inflateEnd(&zf->zstream);
+}
+
+/*
+** @description: This function is called to get the content encoding of
+** the request body.
+** @para: ngx_http_request_t *r
+** @return: static ngx_str_t * or NULL if not encoded.
+*/
+
+static ngx_str_t *
+yy_sec_waf_inflate_encoding(ngx_http_request_t *r)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == sizeof("Content-Encoding") - 1
+            && ngx_strncasecmp(h[i].key.data, (u_char *) "Content-Encoding",
+                               h[i].key.len) == 0)
+        {
+            return &h[i].value;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+** @description: This function is called to set up inflating the body of a
+** request sent with Content-Encoding gzip or deflate.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK, NGX_DECLINED if the body is not compressed or NGX_ERROR.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_inflate_init(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx)
+{
+    ngx_str_t                      *encoding;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_yy_sec_waf_inflate_t  *zf;
+
+    encoding = yy_sec_waf_inflate_encoding(r);
+
+    if (encoding == NULL) {
+        return NGX_DECLINED;
+    }
+
+    /* deflate is the zlib format, which zlib tells from gzip by its header */
+    if (!((encoding->len == 4
+           && ngx_strncasecmp(encoding->data, (u_char *) "gzip", 4) == 0)
+          || (encoding->len == 6
+              && ngx_strncasecmp(encoding->data, (u_char *) "x-gzip", 6) == 0)
+          || (encoding->len == 7
+              && ngx_strncasecmp(encoding->data, (u_char *) "deflate", 7) == 0)))
+    {
+        return NGX_DECLINED;
+    }
+
+    zf = ngx_pcalloc(r->pool, sizeof(ngx_http_yy_sec_waf_inflate_t));
+    if (zf == NULL) {
+        return NGX_ERROR;
+    }
+
+    zf->out = ngx_pnalloc(r->pool, YY_SEC_WAF_INFLATE_BUFFER);
+    if (zf->out == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->alloc_bytes += sizeof(ngx_http_yy_sec_waf_inflate_t)
+                        + YY_SEC_WAF_INFLATE_BUFFER;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    zf->zstream.zalloc = yy_sec_waf_inflate_alloc;
+    zf->zstream.zfree = yy_sec_waf_inflate_free;
+    zf->zstream.opaque = ctx;
+
+    if (inflateInit2(&zf->zstream, MAX_WBITS + 32) != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "[ysec_waf] inflateInit2() failed");
+        return NGX_ERROR;
+    }
+
+    cln->handler = yy_sec_waf_inflate_cleanup;
+    cln->data = zf;
+
+    zf->limit = cf->body_inflate_limit;
+    zf->ratio = cf->body_inflate_ratio;
+
+    ctx->inflate = zf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+        "[ysec_waf] inflating the body, content encoding: %V", encoding);
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to give the next compressed bytes.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: size_t len
+** @return: void
+*/
+
+void
+ngx_http_yy_sec_waf_inflate_input(ngx_http_request_ctx_t *ctx,
+    u_char *p, size_t len)
+{
+    ctx->inflate->zstream.next_in = p;
+    ctx->inflate->zstream.avail_in = len;
+}
+
+/*
+** @description: This function is called to get the next inflated bytes,
+** until the input is used up. They stay valid until the next call.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_str_t *out
+** @return: NGX_AGAIN with bytes in out, NGX_OK once the input is used up
+** or the body is complete, NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_inflate_output(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_str_t *out)
+{
+    int                             rc;
+    z_stream                       *zs;
+    ngx_http_yy_sec_waf_inflate_t  *zf;
+
+    zf = ctx->inflate;
+    zs = &zf->zstream;
+
+    if (zf->failed) {
+        return NGX_ERROR;
+    }
+
+    if (zf->done || (zs->avail_in == 0 && !zf->more)) {
+        return NGX_OK;
+    }
+
+    zs->next_out = zf->out;
+    zs->avail_out = YY_SEC_WAF_INFLATE_BUFFER;
+
+    rc = inflate(zs, Z_NO_FLUSH);
+
+    if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "[ysec_waf] inflate() failed: %d, %s", rc,
+            zs->msg ? zs->msg : "");
+
+        return yy_sec_waf_inflate_error(ctx, "UNCOMMON_CONTENT_ENCODING");
+    }
+
+    zf->more = (zs->avail_out == 0);
+
+    if (rc == Z_STREAM_END) {
+        zf->done = 1;
+    }
+
+    if (zf->limit && zs->total_out > zf->limit) {
+        return yy_sec_waf_inflate_error(ctx, "UNCOMMON_INFLATE_SIZE");
+    }
+
+    /* a few kilobytes may inflate well, only a large output is judged */
+    if (zf->ratio && zs->total_out > YY_SEC_WAF_INFLATE_BUFFER
+        && zs->total_out / zf->ratio > zs->total_in)
+    {
+        return yy_sec_waf_inflate_error(ctx, "UNCOMMON_INFLATE_RATIO");
+    }
+
+    out->data = zf->out;
+    out->len = YY_SEC_WAF_INFLATE_BUFFER - zs->avail_out;
+
+    if (out->len == 0) {
+        zf->more = 0;
+        return NGX_OK;
+    }
+
+    return NGX_AGAIN;
+}
+
+/*
+** @description: This function is called at the end of the body, which must
+** have ended the compressed stream.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_inflate_finish(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    ngx_http_yy_sec_waf_inflate_t  *zf;
+
+    zf = ctx->inflate;
+
+    if (zf->failed) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+        "[ysec_waf] inflated %uz bytes to %uz",
+        (size_t) zf->zstream.total_in, (size_t) zf->zstream.total_out);
+
+    if (!zf->done) {
+        return yy_sec_waf_inflate_error(ctx, "UNCOMMON_CONTENT_ENCODING");
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,274 @@
+#include "ngx_yy_sec_waf.h"
+
+/*
+** @description: This function is called to add an address or a network to
+** an address list.
+** @para: ngx_conf_t *cf
+** @para: ngx_http_yy_sec_waf_ip_list_t *list
+** @para: ngx_str_t *name, the file read
+** @para: ngx_uint_t line
+** @para: ngx_str_t *text
+** @return: static NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+yy_sec_waf_ip_list_add(ngx_conf_t *cf, ngx_http_yy_sec_waf_ip_list_t *list,
+    ngx_str_t *name, ngx_uint_t line, ngx_str_t *text)
+{
+    ngx_int_t   rc;
+    ngx_cidr_t  cidr;
+
+    rc = ngx_ptocidr(text, &cidr);
+
+    if (rc == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[ysec_waf] invalid network \"%V\" in %V:%ui",
+                           text, name, line);
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_DONE) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "[ysec_waf] low address bits of %V are meaningless"
+                           " in %V:%ui", text, name, line);
+    }
+
+    switch (cidr.family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        rc = ngx_radix128tree_insert(list->tree6, cidr.u.in6.addr.s6_addr,
+                                     cidr.u.in6.mask.s6_addr, 1);
+        break;
+#endif
+
+    default: /* AF_INET */
+        rc = ngx_radix32tree_insert(list->tree, ntohl(cidr.u.in.addr),
+                                    ntohl(cidr.u.in.mask), 1);
+        break;
+    }
+
+    /* a network listed twice is in the list all the same */
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to read ip_allow_list or
+** ip_deny_list, a file of addresses and networks in CIDR notation, separated
+** by white space, with comments from # to the end of the line. A directive
+** given again at the same level adds its file to the same list.
+** @para: ngx_conf_t *cf
+** @para: ngx_command_t *cmd
+** @para: void *conf
+** @return: NGX_CONF_OK or NGX_CONF_ERROR if failed.
+*/
+
+char *
+ngx_http_yy_sec_waf_ip_list(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char  *p = conf;
+
+    u_char                          *base, *pos, *last, *start;
+    size_t                           size;
+    ssize_t                          n;
+    ngx_str_t                       *value, text;
+    ngx_uint_t                       line, count;
+    ngx_file_t                       file;
+    ngx_file_info_t                  fi;
+    ngx_http_yy_sec_waf_ip_list_t  **list;
+
+    value = cf->args->elts;
+
+    list = (ngx_http_yy_sec_waf_ip_list_t **) (p + cmd->offset);
+
+    if (*list == NULL) {
+        *list = ngx_pcalloc(cf->pool, sizeof(ngx_http_yy_sec_waf_ip_list_t));
+        if (*list == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        (*list)->tree = ngx_radix_tree_create(cf->pool, -1);
+        if ((*list)->tree == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+#if (NGX_HAVE_INET6)
+        (*list)->tree6 = ngx_radix_tree_create(cf->pool, -1);
+        if ((*list)->tree6 == NULL) {
+            return NGX_CONF_ERROR;
+        }
+#endif
+    }
+
+    if (ngx_conf_full_name(cf->cycle, &value[1], 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = value[1];
+    file.log = cf->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY,
+                            NGX_FILE_OPEN, NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%s\" failed", file.name.data);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
+                           ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto failed;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    /* the file is only needed until it is in the trees */
+    base = ngx_alloc(size + 1, cf->log);
+    if (base == NULL) {
+        goto failed;
+    }
+
+    n = ngx_read_file(&file, base, size, 0);
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    if (n != (ssize_t) size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[ysec_waf] failed to read \"%V\"", &file.name);
+        ngx_free(base);
+        return NGX_CONF_ERROR;
+    }
+
+    pos = base;
+    last = base + size;
+    line = 1;
+    count = 0;
+
+    while (pos < last) {
+
+        switch (*pos) {
+
+        case '\n':
+            line++;
+            /* fall through */
+
+        case ' ':
+        case '\t':
+        case '\r':
+            pos++;
+            continue;
+
+        case '#':
+            while (pos < last && *pos != '\n') {
+                pos++;
+            }
+
+            continue;
+        }
+
+        start = pos;
+
+        while (pos < last && *pos != ' ' && *pos != '\t' && *pos != '\r'
+               && *pos != '\n' && *pos != '#')
+        {
+            pos++;
+        }
+
+        text.data = start;
+        text.len = pos - start;
+
+        if (yy_sec_waf_ip_list_add(cf, *list, &file.name, line, &text)
+            != NGX_OK)
+        {
+            ngx_free(base);
+            return NGX_CONF_ERROR;
+        }
+
+        count++;
+    }
+
+    ngx_free(base);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "[ysec_waf] %ui networks read from \"%V\"",
+                   count, &file.name);
+
+    return NGX_CONF_OK;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    return NGX_CONF_ERROR;
+}
+
+/*
+** @description: This function is called to look the address of the client
+** up in an address list, as the binary address of the connection.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_ip_list_t *list
+** @return: NGX_OK if listed, NGX_DECLINED if not or without a list.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_ip_list_find(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_ip_list_t *list)
+{
+    uintptr_t             value;
+    struct sockaddr_in   *sin;
+#if (NGX_HAVE_INET6)
+    u_char               *p;
+    in_addr_t             addr;
+    struct sockaddr_in6  *sin6;
+#endif
+
+    if (list == NULL) {
+        return NGX_DECLINED;
+    }
+
+    switch (r->connection->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) r->connection->sockaddr;
+        p = sin6->sin6_addr.s6_addr;
+
+        /* an IPv4 client of a dual stack socket is in the IPv4 tree */
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            addr = (in_addr_t) p[12] << 24;
+            addr |= p[13] << 16;
+            addr |= p[14] << 8;
+            addr |= p[15];
+
+            value = ngx_radix32tree_find(list->tree, addr);
+            break;
+        }
+
+        value = ngx_radix128tree_find(list->tree6, p);
+        break;
+#endif
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) r->connection->sockaddr;
+        value = ngx_radix32tree_find(list->tree, ntohl(sin->sin_addr.s_addr));
+        break;
+
+    default:
+        return NGX_DECLINED;
+    }
+
+    return (value == NGX_RADIX_NO_VALUE) ? NGX_DECLINED : NGX_OK;
+}
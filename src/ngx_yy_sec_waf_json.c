@@ -0,0 +1,595 @@
+#include "ngx_yy_sec_waf.h"
+
+/* the decoded tokens are appended to blocks of at least this size */
+#define YY_SEC_WAF_JSON_BLOCK  4096
+
+#define JSON_VALUE          0
+#define JSON_VALUE_OR_END   1
+#define JSON_KEY            2
+#define JSON_KEY_OR_END     3
+#define JSON_COLON          4
+#define JSON_AFTER_VALUE    5
+#define JSON_STRING         6
+#define JSON_ESCAPE         7
+#define JSON_UNICODE        8
+#define JSON_SCALAR         9
+#define JSON_ERROR          10
+
+struct ngx_http_yy_sec_waf_json_s {
+    ngx_uint_t  state;
+
+    /* '{' or '[' of each open level */
+    u_char     *stack;
+    ngx_uint_t  depth;
+    ngx_uint_t  max_depth;
+    size_t      max_len;
+
+    /* the token being decoded, from tok to pos, in a block ending at end */
+    u_char     *tok;
+    u_char     *pos;
+    u_char     *end;
+    ngx_flag_t  key;
+
+    /* \uXXXX being read, and whether the token ends with a high surrogate */
+    uint32_t    ucs;
+    ngx_uint_t  digits;
+    uint32_t    high;
+};
+
+#define yy_sec_waf_json_space(c)                                              \
+    ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+/*
+** @description: This function is called to stop the tokenizer on a
+** malformed body or one over the limits.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: char *msg
+** @return: static ngx_int_t (NGX_ERROR)
+*/
+
+static ngx_int_t
+yy_sec_waf_json_error(ngx_http_request_ctx_t *ctx, char *msg)
+{
+    ctx->json->state = JSON_ERROR;
+    ctx->process_body_error = 1;
+    ctx->process_body_error_msg.data = (u_char *) msg;
+    ctx->process_body_error_msg.len = ngx_strlen(msg);
+
+    return NGX_ERROR;
+}
+
+/*
+** @description: This function is called to append decoded bytes to the
+** current token. A token never moves once it is complete, so the
+** collections point into the blocks.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: size_t n
+** @return: static ngx_int_t (NGX_OK or NGX_ERROR if failed)
+*/
+
+static ngx_int_t
+yy_sec_waf_json_put(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx,
+    u_char *p, size_t n)
+{
+    u_char                      *block;
+    size_t                       len, size;
+    ngx_http_yy_sec_waf_json_t  *js;
+
+    js = ctx->json;
+    len = js->pos - js->tok;
+
+    if (len + n > js->max_len) {
+        return yy_sec_waf_json_error(ctx, "UNCOMMON_JSON_SIZE");
+    }
+
+    if ((size_t) (js->end - js->pos) < n) {
+        size = ngx_max(YY_SEC_WAF_JSON_BLOCK, 2 * (len + n));
+
+        block = ngx_pnalloc(r->pool, size);
+        if (block == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->alloc_bytes += size;
+
+        js->pos = ngx_cpymem(block, js->tok, len);
+        js->tok = block;
+        js->end = block + size;
+    }
+
+    js->pos = ngx_cpymem(js->pos, p, n);
+    js->high = 0;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to append a code point of a \u
+** escape as utf-8. A surrogate pair becomes one four byte sequence, a lone
+** surrogate is kept as its three bytes.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: static ngx_int_t (NGX_OK or NGX_ERROR if failed)
+*/
+
+static ngx_int_t
+yy_sec_waf_json_put_ucs(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx)
+{
+    u_char                       buf[4], *p;
+    uint32_t                     c, high;
+    ngx_http_yy_sec_waf_json_t  *js;
+
+    js = ctx->json;
+    c = js->ucs;
+    high = js->high;
+
+    /* the high surrogate is the last 3 bytes of this token, never of the
+       one before it */
+    if (high && c >= 0xdc00 && c <= 0xdfff && js->pos - js->tok >= 3) {
+        js->pos -= 3;
+        c = 0x10000 + ((high - 0xd800) << 10) + (c - 0xdc00);
+    }
+
+    p = buf;
+
+    if (c < 0x80) {
+        *p++ = (u_char) c;
+
+    } else if (c < 0x800) {
+        *p++ = (u_char) (0xc0 | (c >> 6));
+        *p++ = (u_char) (0x80 | (c & 0x3f));
+
+    } else if (c < 0x10000) {
+        *p++ = (u_char) (0xe0 | (c >> 12));
+        *p++ = (u_char) (0x80 | ((c >> 6) & 0x3f));
+        *p++ = (u_char) (0x80 | (c & 0x3f));
+
+    } else {
+        *p++ = (u_char) (0xf0 | (c >> 18));
+        *p++ = (u_char) (0x80 | ((c >> 12) & 0x3f));
+        *p++ = (u_char) (0x80 | ((c >> 6) & 0x3f));
+        *p++ = (u_char) (0x80 | (c & 0x3f));
+    }
+
+    if (yy_sec_waf_json_put(r, ctx, buf, p - buf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (c >= 0xd800 && c <= 0xdbff) {
+        js->high = c;
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called when a key or a leaf value is
+** complete, to add it to JSON_ARGS_NAMES or JSON_ARGS.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_array_t *collection
+** @return: static ngx_int_t (NGX_OK or NGX_ERROR if failed)
+*/
+
+static ngx_int_t
+yy_sec_waf_json_emit(ngx_http_request_ctx_t *ctx, ngx_array_t *collection)
+{
+    ngx_str_t                   *str;
+    ngx_http_yy_sec_waf_json_t  *js;
+
+    js = ctx->json;
+
+    str = ngx_array_push(collection);
+    if (str == NULL) {
+        return NGX_ERROR;
+    }
+
+    str->data = js->tok;
+    str->len = js->pos - js->tok;
+
+    js->tok = js->pos;
+    js->high = 0;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called when a number, true, false or null
+** is complete.
+** @para: ngx_http_request_ctx_t *ctx
+** @return: static ngx_int_t (NGX_OK or NGX_ERROR if failed)
+*/
+
+static ngx_int_t
+yy_sec_waf_json_scalar(ngx_http_request_ctx_t *ctx)
+{
+    u_char                      *p;
+    size_t                       len;
+    ngx_http_yy_sec_waf_json_t  *js;
+
+    js = ctx->json;
+    p = js->tok;
+    len = js->pos - js->tok;
+
+    if (len == 0) {
+        return yy_sec_waf_json_error(ctx, "UNCOMMON_JSON_FORMAT");
+    }
+
+    if ((len == 4 && ngx_strncmp(p, "true", 4) == 0)
+        || (len == 5 && ngx_strncmp(p, "false", 5) == 0)
+        || (len == 4 && ngx_strncmp(p, "null", 4) == 0))
+    {
+        return yy_sec_waf_json_emit(ctx, &ctx->json_args);
+    }
+
+    if (*p == '-') {
+        p++;
+    }
+
+    if (p == js->pos || *p < '0' || *p > '9') {
+        return yy_sec_waf_json_error(ctx, "UNCOMMON_JSON_FORMAT");
+    }
+
+    for ( /* void */ ; p < js->pos; p++) {
+        if ((*p < '0' || *p > '9') && *p != '.' && *p != 'e' && *p != 'E'
+            && *p != '+' && *p != '-')
+        {
+            return yy_sec_waf_json_error(ctx, "UNCOMMON_JSON_FORMAT");
+        }
+    }
+
+    return yy_sec_waf_json_emit(ctx, &ctx->json_args);
+}
+
+/*
+** @description: This function is called to start tokenizing a json body.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_json_init(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx)
+{
+    ngx_http_yy_sec_waf_json_t  *js;
+
+    js = ngx_pcalloc(r->pool, sizeof(ngx_http_yy_sec_waf_json_t));
+    if (js == NULL) {
+        return NGX_ERROR;
+    }
+
+    js->stack = ngx_pnalloc(r->pool, cf->json_depth_limit + 1);
+    if (js->stack == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->alloc_bytes += sizeof(ngx_http_yy_sec_waf_json_t)
+                        + cf->json_depth_limit + 1;
+
+    if (ngx_array_init(&ctx->json_args, r->pool, 8, sizeof(ngx_str_t))
+        != NGX_OK
+        || ngx_array_init(&ctx->json_names, r->pool, 8, sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    js->max_depth = cf->json_depth_limit;
+    js->max_len = cf->json_value_limit;
+    js->state = JSON_VALUE;
+
+    ctx->json = js;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to tokenize the next bytes of a
+** json body. No tree is built, only the keys and the decoded leaf values
+** are kept, whichever way the body is cut into buffers.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: size_t len
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_json_feed(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, size_t len)
+{
+    u_char                      *last, *q, c;
+    ngx_http_yy_sec_waf_json_t  *js;
+
+    js = ctx->json;
+    last = p + len;
+
+    while (p < last) {
+
+        c = *p;
+
+        switch (js->state) {
+
+        case JSON_VALUE_OR_END:
+            if (yy_sec_waf_json_space(c)) {
+                p++;
+                break;
+            }
+
+            if (c == ']') {
+                js->depth--;
+                js->state = JSON_AFTER_VALUE;
+                p++;
+                break;
+            }
+
+            /* fall through */
+
+        case JSON_VALUE:
+            if (yy_sec_waf_json_space(c)) {
+                p++;
+                break;
+            }
+
+            if (c == '{' || c == '[') {
+                if (js->depth == js->max_depth) {
+                    return yy_sec_waf_json_error(ctx, "UNCOMMON_JSON_DEPTH");
+                }
+
+                js->stack[js->depth++] = c;
+                js->state = (c == '{') ? JSON_KEY_OR_END : JSON_VALUE_OR_END;
+                p++;
+                break;
+            }
+
+            if (c == '"') {
+                js->key = 0;
+                js->state = JSON_STRING;
+                p++;
+                break;
+            }
+
+            js->state = JSON_SCALAR;
+            break;
+
+        case JSON_KEY_OR_END:
+        case JSON_KEY:
+            if (yy_sec_waf_json_space(c)) {
+                p++;
+                break;
+            }
+
+            if (c == '}' && js->state == JSON_KEY_OR_END) {
+                js->depth--;
+                js->state = JSON_AFTER_VALUE;
+                p++;
+                break;
+            }
+
+            if (c != '"') {
+                return yy_sec_waf_json_error(ctx, "UNCOMMON_JSON_FORMAT");
+            }
+
+            js->key = 1;
+            js->state = JSON_STRING;
+            p++;
+            break;
+
+        case JSON_COLON:
+            if (yy_sec_waf_json_space(c)) {
+                p++;
+                break;
+            }
+
+            if (c != ':') {
+                return yy_sec_waf_json_error(ctx, "UNCOMMON_JSON_FORMAT");
+            }
+
+            js->state = JSON_VALUE;
+            p++;
+            break;
+
+        case JSON_AFTER_VALUE:
+            if (yy_sec_waf_json_space(c)) {
+                p++;
+                break;
+            }
+
+            /* only white space after the top level value */
+            if (js->depth == 0) {
+                return yy_sec_waf_json_error(ctx, "UNCOMMON_JSON_FORMAT");
+            }
+
+            if (c == ',') {
+                js->state = (js->stack[js->depth - 1] == '{')
+                            ? JSON_KEY : JSON_VALUE;
+
+            } else if ((c == '}' && js->stack[js->depth - 1] == '{')
+                       || (c == ']' && js->stack[js->depth - 1] == '['))
+            {
+                js->depth--;
+
+            } else {
+                return yy_sec_waf_json_error(ctx, "UNCOMMON_JSON_FORMAT");
+            }
+
+            p++;
+            break;
+
+        case JSON_STRING:
+            /* the plain run up to a quote, an escape or a control byte */
+            for (q = p; q < last && *q != '"' && *q != '\\' && *q >= 0x20; q++) {
+                /* void */
+            }
+
+            if (q > p && yy_sec_waf_json_put(r, ctx, p, q - p) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            p = q;
+
+            if (p == last) {
+                break;
+            }
+
+            if (*p == '\\') {
+                js->state = JSON_ESCAPE;
+                p++;
+                break;
+            }
+
+            if (*p != '"') {
+                return yy_sec_waf_json_error(ctx, "UNCOMMON_JSON_FORMAT");
+            }
+
+            if (yy_sec_waf_json_emit(ctx, js->key ? &ctx->json_names
+                                                  : &ctx->json_args)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            js->state = js->key ? JSON_COLON : JSON_AFTER_VALUE;
+            p++;
+            break;
+
+        case JSON_ESCAPE:
+            switch (c) {
+            case '"':
+            case '\\':
+            case '/':
+                break;
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'u':
+                js->ucs = 0;
+                js->digits = 0;
+                js->state = JSON_UNICODE;
+                p++;
+                continue;
+            default:
+                return yy_sec_waf_json_error(ctx, "UNCOMMON_JSON_FORMAT");
+            }
+
+            if (yy_sec_waf_json_put(r, ctx, &c, 1) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            js->state = JSON_STRING;
+            p++;
+            break;
+
+        case JSON_UNICODE:
+            if (c >= '0' && c <= '9') {
+                js->ucs = (js->ucs << 4) | (c - '0');
+
+            } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+                js->ucs = (js->ucs << 4) | ((c | 0x20) - 'a' + 10);
+
+            } else {
+                return yy_sec_waf_json_error(ctx, "UNCOMMON_HEX_ENCODING");
+            }
+
+            p++;
+
+            if (++js->digits < 4) {
+                break;
+            }
+
+            if (yy_sec_waf_json_put_ucs(r, ctx) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            js->state = JSON_STRING;
+            break;
+
+        case JSON_SCALAR:
+            for (q = p; q < last
+                        && ((*q >= '0' && *q <= '9') || (*q >= 'a' && *q <= 'z')
+                            || *q == '.' || *q == '+' || *q == '-'
+                            || *q == 'E');
+                 q++)
+            {
+                /* void */
+            }
+
+            if (q > p && yy_sec_waf_json_put(r, ctx, p, q - p) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            p = q;
+
+            if (p == last) {
+                break;
+            }
+
+            if (yy_sec_waf_json_scalar(ctx) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            js->state = JSON_AFTER_VALUE;
+            break;
+
+        default: /* JSON_ERROR */
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called at the end of a json body, which
+** must hold exactly one complete value.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_json_finish(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    ngx_http_yy_sec_waf_json_t  *js;
+
+    js = ctx->json;
+
+    if (js->state == JSON_ERROR) {
+        return NGX_ERROR;
+    }
+
+    /* a number at the top level ends with the body */
+    if (js->state == JSON_SCALAR && js->depth == 0) {
+        if (yy_sec_waf_json_scalar(ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        js->state = JSON_AFTER_VALUE;
+    }
+
+    if (js->state != JSON_AFTER_VALUE || js->depth != 0) {
+        return yy_sec_waf_json_error(ctx, "UNCOMMON_JSON_FORMAT");
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+        "[ysec_waf] json: %ui names, %ui values",
+        ctx->json_names.nelts, ctx->json_args.nelts);
+
+    return NGX_OK;
+}
@@ -4,6 +4,7 @@ static ngx_int_t ngx_http_yy_sec_waf_preconfiguration(ngx_conf_t *cf);
 static ngx_int_t ngx_http_yy_sec_waf_init(ngx_conf_t *cf);
 static ngx_int_t ngx_http_yy_sec_waf_handler(ngx_http_request_t *r);
 static void ngx_http_yy_sec_waf_request_body_handler(ngx_http_request_t *r);
+static void * ngx_http_yy_sec_waf_create_main_conf(ngx_conf_t *cf);
 static void * ngx_http_yy_sec_waf_create_loc_conf(ngx_conf_t *cf);
 static char * ngx_http_yy_sec_waf_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
@@ -22,9 +23,19 @@ extern ngx_int_t ngx_http_yy_sec_waf_process_request(ngx_http_request_t *r,
     ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx);
 
 extern ngx_int_t ngx_http_yy_sec_waf_re_create(ngx_conf_t *cf);
+extern void yy_sec_waf_re_cache_init_rbtree(ngx_rbtree_t *rbtree,
+    ngx_rbtree_node_t *sentinel);
+extern ngx_int_t ngx_http_yy_sec_waf_re_count_stats(ngx_cycle_t *cycle);
+extern void ngx_http_yy_sec_waf_re_init_stats(ngx_atomic_t *counters);
+extern ngx_int_t ngx_http_yy_sec_waf_re_compile_phases(ngx_conf_t *cf,
+    ngx_http_yy_sec_waf_loc_conf_t *prev, ngx_http_yy_sec_waf_loc_conf_t *conf);
 extern ngx_int_t yy_sec_waf_re_process_normal_rules(ngx_http_request_t *r,
     ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx, ngx_uint_t phase);
 static ngx_int_t ngx_http_yy_sec_waf_module_init(ngx_cycle_t *cycle);
+#if (nginx_version >= 1007011)
+static ngx_int_t ngx_http_yy_sec_waf_request_body_filter(ngx_http_request_t *r,
+    ngx_chain_t *in);
+#endif
 
 static ngx_atomic_t   request_matched0;
 static ngx_atomic_t   request_blocked0;
@@ -38,6 +49,20 @@ ngx_atomic_t   *request_logged  = &request_logged0;
 
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+#if (nginx_version >= 1007011)
+static ngx_http_request_body_filter_pt   ngx_http_next_request_body_filter;
+#endif
+
+/* responses of other types pass by the RESPONSE_BODY rules */
+static ngx_str_t  ngx_http_yy_sec_waf_response_types[] = {
+    ngx_string("text/html"),
+    ngx_string("text/plain"),
+    ngx_string("text/xml"),
+    ngx_string("application/json"),
+    ngx_string("application/xml"),
+    ngx_string("application/javascript"),
+    ngx_null_string
+};
 
 static ngx_command_t  ngx_http_yy_sec_waf_commands[] = {
     { ngx_string("yy_sec_waf"),
@@ -54,6 +79,20 @@ static ngx_command_t  ngx_http_yy_sec_waf_commands[] = {
       offsetof(ngx_http_yy_sec_waf_loc_conf_t, conn_processor),
       NULL },
 
+    { ngx_string("yy_sec_waf_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_yy_sec_waf_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("yy_sec_waf_ban"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_ANY,
+      ngx_http_yy_sec_waf_ban,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("body_processor"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -61,6 +100,90 @@ static ngx_command_t  ngx_http_yy_sec_waf_commands[] = {
       offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_processor),
       NULL },
 
+    { ngx_string("regex_set"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, regex_set),
+      NULL },
+
+    { ngx_string("body_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_limit),
+      NULL },
+
+    { ngx_string("body_inspect_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_inspect_limit),
+      NULL },
+
+    { ngx_string("body_streaming"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_streaming),
+      NULL },
+
+    { ngx_string("body_streaming_window"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_streaming_window),
+      NULL },
+
+    { ngx_string("json_depth_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, json_depth_limit),
+      NULL },
+
+    { ngx_string("json_value_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, json_value_limit),
+      NULL },
+
+    { ngx_string("response_body_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, response_body_limit),
+      NULL },
+
+    { ngx_string("response_body_types"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_types_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, response_body_types_keys),
+      &ngx_http_yy_sec_waf_response_types[0] },
+
+    { ngx_string("body_inflate"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_inflate),
+      NULL },
+
+    { ngx_string("body_inflate_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_inflate_limit),
+      NULL },
+
+    { ngx_string("body_inflate_ratio"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_inflate_ratio),
+      NULL },
+
     { ngx_string("basic_rule"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
       ngx_http_yy_sec_waf_re_read_conf,
@@ -75,6 +198,20 @@ static ngx_command_t  ngx_http_yy_sec_waf_commands[] = {
       0,
       NULL },
 
+    { ngx_string("ip_allow_list"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_yy_sec_waf_ip_list,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, ip_allow_list),
+      NULL },
+
+    { ngx_string("ip_deny_list"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_yy_sec_waf_ip_list,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, ip_deny_list),
+      NULL },
+
     { ngx_string("denied_url"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LMT_CONF|NGX_CONF_TAKE1,
       ngx_http_yy_sec_waf_re_read_denied_url_conf,
@@ -90,7 +227,7 @@ static ngx_http_module_t  ngx_http_yy_sec_waf_module_ctx = {
     ngx_http_yy_sec_waf_preconfiguration,  /* preconfiguration */
     ngx_http_yy_sec_waf_init,              /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
+    ngx_http_yy_sec_waf_create_main_conf,  /* create main configuration */
     NULL,                                  /* init main configuration */
 
     NULL,                                  /* create server configuration */
@@ -116,6 +253,32 @@ ngx_module_t  ngx_http_yy_sec_waf_module = {
 };
 
 
+/*
+** @description: This function is called to create the main configuration of yy sec waf.
+** @para: ngx_conf_t *cf
+** @return: conf or NULL if failed.
+*/
+
+static void *
+ngx_http_yy_sec_waf_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_yy_sec_waf_main_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_yy_sec_waf_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&conf->zones, cf->pool, 1,
+                       sizeof(ngx_http_yy_sec_waf_zone_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return conf;
+}
+
 /*
 ** @description: This function is called to create the location configuration of yy sec waf.
 ** @para: ngx_conf_t *cf
@@ -136,6 +299,17 @@ ngx_http_yy_sec_waf_create_loc_conf(ngx_conf_t *cf)
     conf->enabled = NGX_CONF_UNSET;
     conf->conn_processor = NGX_CONF_UNSET;
     conf->body_processor = NGX_CONF_UNSET;
+    conf->regex_set = NGX_CONF_UNSET;
+    conf->body_limit = NGX_CONF_UNSET_SIZE;
+    conf->body_inspect_limit = NGX_CONF_UNSET_SIZE;
+    conf->body_streaming = NGX_CONF_UNSET;
+    conf->body_streaming_window = NGX_CONF_UNSET_SIZE;
+    conf->json_depth_limit = NGX_CONF_UNSET_UINT;
+    conf->json_value_limit = NGX_CONF_UNSET_SIZE;
+    conf->body_inflate = NGX_CONF_UNSET;
+    conf->response_body_limit = NGX_CONF_UNSET_SIZE;
+    conf->body_inflate_limit = NGX_CONF_UNSET_SIZE;
+    conf->body_inflate_ratio = NGX_CONF_UNSET_UINT;
 
     return conf;
 }
@@ -151,7 +325,6 @@ ngx_http_yy_sec_waf_create_loc_conf(ngx_conf_t *cf)
 static char *
 ngx_http_yy_sec_waf_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 {
-    (void) cf;
     ngx_http_yy_sec_waf_loc_conf_t *prev = parent;
     ngx_http_yy_sec_waf_loc_conf_t *conf = child;
 
@@ -165,8 +338,10 @@ ngx_http_yy_sec_waf_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         conf->response_body_rules = prev->response_body_rules;
     if (conf->block_list == NULL)
         conf->block_list = prev->block_list;
-    if (conf->shm_zone == NULL)
-        conf->shm_zone = prev->shm_zone;
+    if (conf->ip_allow_list == NULL)
+        conf->ip_allow_list = prev->ip_allow_list;
+    if (conf->ip_deny_list == NULL)
+        conf->ip_deny_list = prev->ip_deny_list;
     if (conf->server_ip.len == 0)
         conf->server_ip = prev->server_ip;
     if (conf->denied_url.len == 0)
@@ -176,8 +351,71 @@ ngx_http_yy_sec_waf_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->conn_processor, prev->conn_processor, 0);
 
+    if (conf->conn_processor
+        && ngx_http_yy_sec_waf_default_zone(cf) != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
     ngx_conf_merge_value(conf->body_processor, prev->body_processor, 1);
 
+    ngx_conf_merge_value(conf->regex_set, prev->regex_set, 0);
+
+    ngx_conf_merge_size_value(conf->body_limit, prev->body_limit, 0);
+
+    ngx_conf_merge_size_value(conf->body_inspect_limit,
+                              prev->body_inspect_limit, 0);
+
+    ngx_conf_merge_value(conf->body_streaming, prev->body_streaming, 0);
+
+    ngx_conf_merge_size_value(conf->body_streaming_window,
+                              prev->body_streaming_window, 1024);
+
+    ngx_conf_merge_uint_value(conf->json_depth_limit,
+                              prev->json_depth_limit, 32);
+
+    ngx_conf_merge_size_value(conf->json_value_limit,
+                              prev->json_value_limit, 65536);
+
+    ngx_conf_merge_value(conf->body_inflate, prev->body_inflate, 1);
+
+    ngx_conf_merge_size_value(conf->response_body_limit,
+                              prev->response_body_limit, 1024 * 1024);
+
+    if (ngx_http_merge_types(cf, &conf->response_body_types_keys,
+                             &conf->response_body_types,
+                             &prev->response_body_types_keys,
+                             &prev->response_body_types,
+                             ngx_http_yy_sec_waf_response_types)
+        != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_size_value(conf->body_inflate_limit,
+                              prev->body_inflate_limit, 1024 * 1024);
+
+    ngx_conf_merge_uint_value(conf->body_inflate_ratio,
+                              prev->body_inflate_ratio, 100);
+
+#if (nginx_version < 1007011)
+    if (conf->body_streaming) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[ysec_waf] body_streaming requires nginx 1.7.11");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    if (ngx_http_yy_sec_waf_re_compile_phases(cf, prev, conf) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "[ysec_waf] failed to compile rules");
+        return NGX_CONF_ERROR;
+    }
+
+    /* Without rules to see it, the body is streamed as nginx would. */
+    conf->need_body = conf->body_processor
+                      && conf->request_body_phase != NULL
+                      && conf->request_body_phase->rules->nelts > 0;
+
     return NGX_CONF_OK;
 }
 
@@ -229,6 +467,19 @@ ngx_http_yy_sec_waf_header_filter(ngx_http_request_t *r)
         }
     }
 
+    /* decided once here, a response not inspected costs nothing per buffer */
+    if (r == r->main && ctx
+        && (cf->response_body_phase == NULL
+            || !cf->response_body_phase->response_body
+            || r->header_only
+            || r->headers_out.content_length_n == 0
+            || (r->headers_out.content_encoding
+                && r->headers_out.content_encoding->value.len)
+            || ngx_http_test_content_type(r, &cf->response_body_types) == NULL))
+    {
+        ctx->response_bypass = 1;
+    }
+
     return ngx_http_next_header_filter(r);
 }
 
@@ -260,16 +511,73 @@ ngx_http_yy_sec_waf_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return ngx_http_next_body_filter(r, in);
     }
 
-    if (r == r->main && ctx && !ctx->process_done) {
+    /* the rules on other variables run once, not for every buffer */
+    if (r == r->main && ctx && !ctx->process_done && !ctx->response_phase_done) {
+        ctx->response_phase_done = 1;
+
         rc = yy_sec_waf_re_process_normal_rules(r, cf, ctx, RESPONSE_BODY_PHASE);
         if (rc != NGX_DECLINED) {
             return ngx_http_filter_finalize_request(r, &ngx_http_yy_sec_waf_module, rc);
         }
     }
 
+    if (r == r->main && ctx && !ctx->process_done && !ctx->response_bypass
+        && in)
+    {
+        rc = ngx_http_yy_sec_waf_stream_response(r, cf, ctx, in);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc != NGX_DECLINED) {
+            return ngx_http_filter_finalize_request(r, &ngx_http_yy_sec_waf_module, rc);
+        }
+
+        /* the rest of the response is past response_body_limit */
+        if (cf->response_body_limit
+            && ctx->response_inspected >= cf->response_body_limit)
+        {
+            ctx->response_bypass = 1;
+        }
+    }
+
     return ngx_http_next_body_filter(r, in);
 }
 
+#if (nginx_version >= 1007011)
+
+/*
+** @description: This function is called to filter the request body as it is read.
+** @para: ngx_http_request_t *r
+** @para: ngx_chain_t *in
+** @return: NGX_OK or the status of the rule matched.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_request_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_int_t                       rc;
+    ngx_http_request_ctx_t         *ctx;
+    ngx_http_yy_sec_waf_loc_conf_t *cf;
+
+    cf = ngx_http_get_module_loc_conf(r, ngx_http_yy_sec_waf_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
+
+    if (cf != NULL && cf->enabled && cf->body_streaming && cf->need_body
+        && r == r->main && ctx && !ctx->process_done)
+    {
+        rc = ngx_http_yy_sec_waf_stream_body(r, cf, ctx, in);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
+    return ngx_http_next_request_body_filter(r, in);
+}
+
+#endif
+
 /*
 ** @description: This function is called to init yy sec waf in process of postconfiguration.
 ** @para: ngx_conf_t *cf
@@ -298,6 +606,11 @@ ngx_http_yy_sec_waf_init(ngx_conf_t *cf)
     ngx_http_next_body_filter = ngx_http_top_body_filter;
     ngx_http_top_body_filter = ngx_http_yy_sec_waf_body_filter;
 
+#if (nginx_version >= 1007011)
+    ngx_http_next_request_body_filter = ngx_http_top_request_body_filter;
+    ngx_http_top_request_body_filter = ngx_http_yy_sec_waf_request_body_filter;
+#endif
+
     return NGX_OK;
 }
 
@@ -305,6 +618,7 @@ ngx_http_yy_sec_waf_init(ngx_conf_t *cf)
 ** @description: This is the function called by nginx : 
 ** - Set up the context for the request
 ** - Check if the job is done and we're called again
+** - run the request header rules, before any byte of the body is read
 ** - if it's a POST/PUT request, setup hook for body data
 ** - call ngx_http_yy_sec_waf_data_parse
 ** - check if the request should be denied
@@ -348,25 +662,78 @@ ngx_http_yy_sec_waf_handler(ngx_http_request_t *r)
         return NGX_DECLINED;
     }
 
-    ctx = ngx_http_yy_sec_waf_create_ctx(r, cf);
-
+    /* the address lists and the ban cost a lookup each, before anything
+       is set up, a client allowed skips the rules altogether */
     if (ctx == NULL) {
-        return NGX_ERROR;
+        if (ngx_http_yy_sec_waf_ip_list_find(r, cf->ip_allow_list) == NGX_OK) {
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] client in ip_allow_list.");
+            ngx_atomic_fetch_add(request_allowed, 1);
+            return NGX_DECLINED;
+        }
+
+        if (ngx_http_yy_sec_waf_ip_list_find(r, cf->ip_deny_list) == NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "[ysec_waf] block, ip_deny_list, client_ip: %V",
+                          &r->connection->addr_text);
+            ngx_atomic_fetch_add(request_blocked, 1);
+            return NGX_HTTP_PRECONDITION_FAILED;
+        }
+
+        rc = ngx_http_yy_sec_waf_ban_check(r);
+
+        if (rc != NGX_DECLINED) {
+            ngx_atomic_fetch_add(request_blocked, 1);
+            return rc;
+        }
     }
 
-    ngx_http_set_ctx(r, ctx, ngx_http_yy_sec_waf_module);
+    if (ctx == NULL) {
+        ctx = ngx_http_yy_sec_waf_create_ctx(r, cf);
 
-    if (cf->conn_processor) {
-        rc = ngx_http_yy_sec_waf_process_conn(ctx);
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_set_ctx(r, ctx, ngx_http_yy_sec_waf_module);
+
+        if (cf->conn_processor) {
+            rc = ngx_http_yy_sec_waf_process_conn(ctx);
 
-        if (rc != NGX_OK) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "[ysec_waf] ngx_http_yy_sec_waf_process_conn failed");
+            if (rc != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "[ysec_waf] ngx_http_yy_sec_waf_process_conn failed");
+                return rc;
+            }
+        }
+    }
+
+    /* A request blocked by its uri or headers never costs the upload. */
+    if (r == r->main && !ctx->header_phase_done) {
+        ctx->header_phase_done = 1;
+
+        rc = yy_sec_waf_re_process_normal_rules(r, cf, ctx, REQUEST_HEADER_PHASE);
+        if (rc != NGX_DECLINED 
+            || ctx->action_level & ACTION_ALLOW
+            || ctx->action_level & ACTION_BLOCK) {
             return rc;
         }
+
+        if (cf->body_limit
+            && r->headers_in.content_length_n > (off_t) cf->body_limit)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "[ysec_waf] body_limit exceeded, content length: %O",
+                          r->headers_in.content_length_n);
+
+            ngx_atomic_fetch_add(request_blocked, 1);
+            ctx->process_done = 1;
+
+            return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+        }
     }
 
     /* This section is prepared for further considerations, such as checking the body of this request.*/
-    if ((r->method == NGX_HTTP_POST || r->method == NGX_HTTP_PUT) && !ctx->read_body_done) {
+    if ((r->method == NGX_HTTP_POST || r->method == NGX_HTTP_PUT)
+        && cf->need_body && !ctx->read_body_done) {
         rc = ngx_http_read_client_request_body(r, ngx_http_yy_sec_waf_request_body_handler);
 
         if (rc == NGX_AGAIN) {
@@ -383,21 +750,25 @@ ngx_http_yy_sec_waf_handler(ngx_http_request_t *r)
     if (r == r->main && ctx && ctx->read_body_done && !ctx->process_done) {
         rc = NGX_DECLINED;
 
-        if (cf->body_processor 
+        /* a streamed body was inspected while it was read */
+        if (cf->need_body && !cf->body_streaming
             && (r->method == NGX_HTTP_POST || r->method == NGX_HTTP_PUT)
             && r->request_body) {
             rc = ngx_http_yy_sec_waf_process_body(r, cf, ctx);
             if (rc == NGX_ERROR) {
                 return NGX_DECLINED;
             }
+
+            /* matched while a compressed body was inflated */
+            if (rc != NGX_OK) {
+                return rc;
+            }
         }
 
-        //Temply hack here, should hook the input filters.
-        rc = yy_sec_waf_re_process_normal_rules(r, cf, ctx, REQUEST_HEADER_PHASE);
-        if (rc != NGX_DECLINED 
-            || ctx->action_level & ACTION_ALLOW
-            || ctx->action_level & ACTION_BLOCK) {
-            return rc;
+        /* the body added args and parts to what the headers had */
+        if (cf->need_body) {
+            yy_sec_waf_re_cache_init_rbtree(&ctx->cache_rbtree,
+                                            &ctx->cache_sentinel);
         }
 
         rc = yy_sec_waf_re_process_normal_rules(r, cf, ctx, REQUEST_BODY_PHASE);
@@ -459,7 +830,12 @@ ngx_http_yy_sec_waf_create_ctx(ngx_http_request_t *r,
         return NULL;
     }
 
-    ngx_http_yy_sec_waf_process_spliturl(r, &r->args, ctx, PROCESS_ARGS);
+    if (cf->need_args
+        && ngx_http_yy_sec_waf_process_spliturl(r, &r->args, ctx,
+                                                PROCESS_ARGS) != NGX_OK)
+    {
+        return NULL;
+    }
 
     ctx->process_body_error = 0;
     ctx->raw_string = &ctx->var;
@@ -474,6 +850,7 @@ ngx_http_yy_sec_waf_create_ctx(ngx_http_request_t *r,
     ctx->r = r;
     ctx->cf = cf;
     ctx->pool = r->pool;
+    ctx->scratch_pool = r->pool;
 
     ctx->server_ip = &cf->server_ip;
 
@@ -515,7 +892,7 @@ ngx_http_yy_sec_waf_create_ctx(ngx_http_request_t *r,
         ctx->real_client_ip = &ctx->r->connection->addr_text;
     }
 
-    //yy_sec_waf_re_cache_init_rbtree(&ctx->cache_rbtree, &ctx->cache_sentinel);
+    yy_sec_waf_re_cache_init_rbtree(&ctx->cache_rbtree, &ctx->cache_sentinel);
 
     return ctx;
 }
@@ -531,12 +908,29 @@ ngx_http_yy_sec_waf_module_init(ngx_cycle_t *cycle)
 {
     u_char              *shared;
     size_t               size, cl;
+    ngx_int_t            nstats;
     ngx_shm_t            shm;
+    ngx_atomic_t        *stats;
     ngx_core_conf_t     *ccf;
 
+    ngx_yy_sec_waf_simd_init();
+
+    /* two counters for each gated regex: rule id */
+    nstats = ngx_http_yy_sec_waf_re_count_stats(cycle);
+    if (nstats == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
     ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
 
     if (ccf->master == 0) {
+        stats = ngx_pcalloc(cycle->pool, 2 * nstats * sizeof(ngx_atomic_t));
+        if (stats == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_yy_sec_waf_re_init_stats(stats);
+
         return NGX_OK;
     }
 
@@ -547,7 +941,8 @@ ngx_http_yy_sec_waf_module_init(ngx_cycle_t *cycle)
     size = cl            /* request_matched */
            + cl          /* request_blocked */
            + cl          /* request_allowed */
-           + cl;         /* request_logged */
+           + cl          /* request_logged */
+           + 2 * nstats * sizeof(ngx_atomic_t);  /* regex_stats */
 
     shm.size = size;
     shm.name.len = sizeof("yy_sec_waf_shared_zone");
@@ -565,6 +960,8 @@ ngx_http_yy_sec_waf_module_init(ngx_cycle_t *cycle)
     request_allowed = (ngx_atomic_t *) (shared + 2 * cl);
     request_logged  = (ngx_atomic_t *) (shared + 3 * cl);
 
+    ngx_http_yy_sec_waf_re_init_stats((ngx_atomic_t *) (shared + 4 * cl));
+
     return NGX_OK;
 }
 
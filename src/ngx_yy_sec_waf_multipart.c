@@ -0,0 +1,652 @@
+#include "ngx_yy_sec_waf.h"
+
+/* a boundary is at most 70 bytes, the delimiter adds "\r\n--" */
+#define YY_SEC_WAF_MULTIPART_DELIM  74
+/* longest header line of a part */
+#define YY_SEC_WAF_MULTIPART_LINE   1024
+
+#define MULTIPART_PREAMBLE      0
+#define MULTIPART_BOUNDARY_END  1
+#define MULTIPART_HEADER        2
+#define MULTIPART_DATA          3
+#define MULTIPART_EPILOGUE      4
+#define MULTIPART_ERROR         5
+
+struct ngx_http_yy_sec_waf_multipart_s {
+    ngx_uint_t  state;
+
+    /* "\r\n--" followed by the boundary */
+    u_char      delim[YY_SEC_WAF_MULTIPART_DELIM];
+    size_t      delim_len;
+    /* Horspool shifts, and the KMP failure function for a delimiter
+       which spans two buffers */
+    u_char      shift[256];
+    u_char      fail[YY_SEC_WAF_MULTIPART_DELIM + 1];
+    /* bytes of the delimiter at the end of the previous buffer */
+    size_t      matched;
+
+    /* offset in the body of the next byte fed */
+    off_t       offset;
+    /* offset of the data of the current part */
+    off_t       part_start;
+
+    u_char      line[YY_SEC_WAF_MULTIPART_LINE];
+    size_t      line_len;
+    ngx_uint_t  headers;
+
+    ngx_str_t   name;
+    ngx_str_t   filename;
+    ngx_str_t   content_type;
+};
+
+/*
+** @description: This function is called to process the boundary of the request.
+** @para: ngx_http_request_t *r
+** @para: u_char **boundary
+** @para: ngx_uint_t *boundary_len
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_process_boundary(ngx_http_request_t *r,
+    u_char **boundary, ngx_uint_t *boundary_len)
+{
+    u_char *start;
+    u_char *end;
+
+    if (r->headers_in.content_type->value.len < ngx_strlen("multipart/form-data;"))
+        return NGX_ERROR;
+
+    start = r->headers_in.content_type->value.data + ngx_strlen("multipart/form-data;");
+    end = r->headers_in.content_type->value.data + r->headers_in.content_type->value.len;
+
+    while (start < end && *start && (*start == ' ' || *start == '\t'))
+        start++;
+
+    if ((size_t) (end - start) < ngx_strlen("boundary=")
+        || ngx_strncmp(start, "boundary=", ngx_strlen("boundary=")))
+        return NGX_ERROR;
+
+    start += ngx_strlen("boundary=");
+
+    *boundary_len = end - start;
+    *boundary = start;
+
+    if (*boundary_len == 0 || *boundary_len > 70)
+        return NGX_ERROR;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to process the disposition of the request.
+** @para: ngx_http_request_t *r
+** @para: u_char *str
+** @para: u_char *line_end
+** @para: ngx_str_t *name
+** @para: ngx_str_t *filename
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_process_disposition(ngx_http_request_t *r,
+    u_char *str, u_char *line_end, ngx_str_t *name, ngx_str_t *filename)
+{
+    u_char *name_start, *name_end, *filename_start, *filename_end;
+
+    name_end = filename_end = NULL;
+
+    while (str < line_end) {
+        while(str < line_end && *str && (*str == ' ' || *str == '\t'))
+            str++;
+        if (str < line_end && *str && *str == ';')
+            str++;
+        while (str < line_end && *str && (*str == ' ' || *str == '\t'))
+            str++;
+
+        if (str >= line_end || !*str)
+            break;
+
+        if ((size_t) (line_end - str) > ngx_strlen("name=\"")
+            && !ngx_strncmp(str, "name=\"", ngx_strlen("name=\""))) {
+            name_start = name_end = str + ngx_strlen("name=\"");
+            do {
+                name_end = (u_char*) ngx_strlchr(name_end, line_end, '"');
+                if (name_end && *(name_end - 1) != '\\')
+                    break;
+                if (name_end)
+                    name_end++;
+            } while (name_end && name_end < line_end);
+
+            if (!name_end || name_end >= line_end)
+                return NGX_ERROR;
+
+            str = name_end;
+
+            if (str < line_end + 1)
+                str++;
+            else
+                return NGX_ERROR;
+
+            name->data = name_start;
+            name->len = name_end - name_start;
+        }
+        else if ((size_t) (line_end - str) > ngx_strlen("filename=\"")
+            && !ngx_strncmp(str, "filename=\"", ngx_strlen("filename=\""))) {
+            filename_end = filename_start = str + ngx_strlen("filename=\"");
+            do {
+                /* ignore 0x00 for %00 injection situation */
+                filename_end = (u_char*) ngx_strlchr(filename_end, line_end, '"');
+                if (filename_end && *(filename_end - 1) != '\\')
+                    break;
+                if (filename_end)
+                    filename_end++;
+            } while (filename_end && filename_end < line_end);
+
+            if (!filename_end || filename_end >= line_end)
+                return NGX_ERROR;
+
+            str = filename_end;
+            if (str < line_end + 1)
+                str++;
+            else
+                return NGX_ERROR;
+
+            filename->data = filename_start;
+            filename->len = filename_end - filename_start;
+        }
+        else if (str == line_end - 1)
+            break;
+        else {
+            return NGX_ERROR;
+        }
+    }
+
+    if (filename_end > line_end || name_end > line_end)
+        return NGX_ERROR;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to stop the parser on a malformed body.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: char *msg
+** @return: static ngx_int_t (NGX_ERROR)
+*/
+
+static ngx_int_t
+yy_sec_waf_multipart_error(ngx_http_request_ctx_t *ctx, char *msg)
+{
+    ctx->multipart->state = MULTIPART_ERROR;
+    ctx->process_body_error = 1;
+    ctx->process_body_error_msg.data = (u_char *) msg;
+    ctx->process_body_error_msg.len = ngx_strlen(msg);
+
+    return NGX_ERROR;
+}
+
+/*
+** @description: This function is called to copy a header value out of the
+** line buffer, which is reused for the next line.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_str_t *str
+** @return: static ngx_int_t (NGX_OK or NGX_ERROR if failed)
+*/
+
+static ngx_int_t
+yy_sec_waf_multipart_copy(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_str_t *str)
+{
+    u_char  *p;
+
+    if (str->data == NULL) {
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, str->len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, str->data, str->len);
+    ctx->copy_bytes += str->len;
+
+    str->data = p;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to look for the delimiter. Horspool
+** skips through the buffer, and a delimiter cut by the end of a buffer is
+** carried over as the count of its bytes already seen.
+** @para: ngx_http_yy_sec_waf_multipart_t *mp
+** @para: u_char *p
+** @para: u_char *last
+** @return: static u_char * (past the delimiter) or NULL if not in the buffer.
+*/
+
+static u_char *
+yy_sec_waf_multipart_search(ngx_http_yy_sec_waf_multipart_t *mp,
+    u_char *p, u_char *last)
+{
+    u_char  *s;
+    size_t   k, m;
+
+    m = mp->delim_len;
+    k = mp->matched;
+
+    /* complete or drop the delimiter begun in the previous buffer */
+    while (k && p < last) {
+        while (k && mp->delim[k] != *p) {
+            k = mp->fail[k];
+        }
+
+        if (mp->delim[k] == *p) {
+            k++;
+        }
+
+        p++;
+
+        if (k == m) {
+            mp->matched = 0;
+            return p;
+        }
+    }
+
+    if (k) {
+        mp->matched = k;
+        return NULL;
+    }
+
+    for (s = p; (size_t) (last - s) >= m; s += mp->shift[s[m - 1]]) {
+        if (s[m - 1] == mp->delim[m - 1]
+            && ngx_memcmp(s, mp->delim, m - 1) == 0)
+        {
+            mp->matched = 0;
+            return s + m;
+        }
+    }
+
+    /* fewer than m bytes are left, keep the longest start of a delimiter */
+    for ( /* void */ ; s < last; s++) {
+        while (k && mp->delim[k] != *s) {
+            k = mp->fail[k];
+        }
+
+        if (mp->delim[k] == *s) {
+            k++;
+        }
+    }
+
+    mp->matched = k;
+
+    return NULL;
+}
+
+/*
+** @description: This function is called when the headers of a part are
+** read, to record and check its name, filename and content type.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: static ngx_int_t (NGX_OK or NGX_ERROR if failed)
+*/
+
+static ngx_int_t
+yy_sec_waf_multipart_part(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx)
+{
+    ngx_uint_t                        nullbytes;
+    ngx_str_t                        *tmp, *filename, *content_type;
+    ngx_http_yy_sec_waf_multipart_t  *mp;
+
+    mp = ctx->multipart;
+
+    if (mp->headers == 0) {
+        return yy_sec_waf_multipart_error(ctx, "UNCOMMON_POST_FORMAT");
+    }
+
+    filename = &mp->filename;
+    content_type = &mp->content_type;
+    nullbytes = 0;
+
+    if (filename->data) {
+        /* already a copy, decoded in place */
+        nullbytes = ngx_yy_sec_waf_unescape(filename);
+    }
+
+    tmp = ngx_array_push(&ctx->multipart_filename);
+    if (tmp == NULL)
+        return NGX_ERROR;
+
+    *tmp = *filename;
+
+    tmp = ngx_array_push(&ctx->multipart_name);
+    if (tmp == NULL)
+        return NGX_ERROR;
+
+    *tmp = mp->name;
+
+    if (filename->data) {
+        tmp = ngx_array_push(&ctx->content_type);
+        if (tmp == NULL)
+            return NGX_ERROR;
+
+        *tmp = *content_type;
+
+        if (nullbytes > 0) {
+            return yy_sec_waf_multipart_error(ctx, "UNCOMMON_HEX_ENCODING");
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "[ysec_waf] checking filename [%V]", filename);
+
+        if (content_type->data) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "[ysec_waf] checking content_type [%V]", content_type);
+
+            if (!ngx_strnstr(filename->data, ".html", filename->len)
+                || !ngx_strnstr(filename->data, ".html", filename->len)) {
+                if (!ngx_strncmp(content_type->data, "text/html", content_type->len)) {
+                    return yy_sec_waf_multipart_error(ctx, "UNCOMMON_FILENAME");
+                }
+            }
+            else if (!ngx_strnstr(filename->data, ".php", filename->len)
+                || !ngx_strnstr(filename->data, ".jsp", filename->len)) {
+                if (!ngx_strncmp(content_type->data, "application/octet-stream", content_type->len)) {
+                    return yy_sec_waf_multipart_error(ctx, "UNCOMMON_FILENAME");
+                }
+            }
+        }
+    } else if (mp->name.data) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "[ysec_waf] checking name [%V]", &mp->name);
+    }
+
+    mp->state = MULTIPART_DATA;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to process a header line of a part,
+** the line buffer ends with '\n'.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: static ngx_int_t (NGX_OK or NGX_ERROR if failed)
+*/
+
+static ngx_int_t
+yy_sec_waf_multipart_header(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx)
+{
+    u_char                           *p, *line_end;
+    size_t                            len;
+    ngx_http_yy_sec_waf_multipart_t  *mp;
+
+    mp = ctx->multipart;
+
+    p = mp->line;
+    line_end = mp->line + mp->line_len - 1;
+
+    /* an empty line ends the headers */
+    if (p == line_end || (p + 1 == line_end && *p == '\r')) {
+        return yy_sec_waf_multipart_part(r, ctx);
+    }
+
+    if (mp->headers++ == 0) {
+        len = ngx_strlen("content-disposition: form-data;");
+
+        if (mp->line_len < len
+            || ngx_strncasecmp(p, (u_char*)"content-disposition: form-data;", len)) {
+            return yy_sec_waf_multipart_error(ctx, "UNCOMMON_POST_FORMAT");
+        }
+
+        ngx_http_yy_sec_waf_process_disposition(r, p + len, line_end,
+                                                &mp->name, &mp->filename);
+
+        if (yy_sec_waf_multipart_copy(r, ctx, &mp->name) != NGX_OK
+            || yy_sec_waf_multipart_copy(r, ctx, &mp->filename) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    len = ngx_strlen("content-type:");
+
+    if (mp->line_len > len
+        && !ngx_strncasecmp(p, (u_char*)"content-type:", len)) {
+        p += len;
+
+        while (p < line_end && (*p == ' ' || *p == '\t'))
+            p++;
+
+        if (line_end > p && *(line_end - 1) == '\r')
+            line_end--;
+
+        mp->content_type.data = p;
+        mp->content_type.len = line_end - p;
+
+        return yy_sec_waf_multipart_copy(r, ctx, &mp->content_type);
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to start parsing a multipart body,
+** from the boundary of the content type.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_multipart_init(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    u_char                           *boundary;
+    size_t                            i, k, m;
+    ngx_uint_t                        boundary_len;
+    ngx_http_yy_sec_waf_multipart_t  *mp;
+
+    if (ngx_http_yy_sec_waf_process_boundary(r, &boundary, &boundary_len) != NGX_OK) {
+        ctx->process_body_error = 1;
+        ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_CONTENT_TYPE");
+        return NGX_ERROR;
+    }
+
+    ctx->boundary = boundary;
+    ctx->boundary_len = boundary_len;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+        "[ysec_waf] boundary: %*s", boundary_len, boundary);
+
+    mp = ngx_pcalloc(r->pool, sizeof(ngx_http_yy_sec_waf_multipart_t));
+    if (mp == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->alloc_bytes += sizeof(ngx_http_yy_sec_waf_multipart_t);
+
+    ngx_memcpy(ngx_cpymem(mp->delim, "\r\n--", 4), boundary, boundary_len);
+    m = mp->delim_len = boundary_len + 4;
+
+    for (i = 0; i < 256; i++) {
+        mp->shift[i] = (u_char) m;
+    }
+
+    for (i = 0; i < m - 1; i++) {
+        mp->shift[mp->delim[i]] = (u_char) (m - 1 - i);
+    }
+
+    /* fail[k], the longest proper border of the first k bytes */
+    for (k = 0, i = 1; i < m; i++) {
+        while (k && mp->delim[i] != mp->delim[k]) {
+            k = mp->fail[k];
+        }
+
+        if (mp->delim[i] == mp->delim[k]) {
+            k++;
+        }
+
+        mp->fail[i + 1] = (u_char) k;
+    }
+
+    /* the body may start with the boundary, as if after a "\r\n" */
+    mp->matched = 2;
+    mp->state = MULTIPART_PREAMBLE;
+
+    ctx->multipart = mp;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to parse the next bytes of a
+** multipart body. Each byte is looked at a bounded number of times, no
+** matter how the body is cut into buffers, and the data of the parts is
+** only tracked by its offsets.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: size_t len
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_multipart_feed(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, size_t len)
+{
+    u_char                           *pos, *last, *q;
+    size_t                            n;
+    ngx_int_t                         rc;
+    ngx_http_yy_sec_waf_multipart_t  *mp;
+
+    mp = ctx->multipart;
+
+    pos = p;
+    last = p + len;
+    rc = NGX_OK;
+
+    while (pos < last && rc == NGX_OK) {
+
+        switch (mp->state) {
+
+        case MULTIPART_PREAMBLE:
+        case MULTIPART_DATA:
+            q = yy_sec_waf_multipart_search(mp, pos, last);
+            if (q == NULL) {
+                pos = last;
+                break;
+            }
+
+            if (mp->state == MULTIPART_DATA) {
+                ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "[ysec_waf] multipart data: %O-%O", mp->part_start,
+                    mp->offset + (q - p) - (off_t) mp->delim_len);
+            }
+
+            mp->state = MULTIPART_BOUNDARY_END;
+            mp->line_len = 0;
+            pos = q;
+            break;
+
+        case MULTIPART_BOUNDARY_END:
+            mp->line[mp->line_len++] = *pos++;
+
+            if (mp->line_len < 2) {
+                break;
+            }
+
+            if (mp->line[0] == '-' && mp->line[1] == '-') {
+                mp->state = MULTIPART_EPILOGUE;
+                break;
+            }
+
+            if (mp->line[0] != '\r' || mp->line[1] != '\n') {
+                rc = yy_sec_waf_multipart_error(ctx, "UNCOMMON_POST_BOUNDARY");
+                break;
+            }
+
+            ngx_memzero(&mp->name, sizeof(ngx_str_t));
+            ngx_memzero(&mp->filename, sizeof(ngx_str_t));
+            ngx_memzero(&mp->content_type, sizeof(ngx_str_t));
+
+            mp->headers = 0;
+            mp->line_len = 0;
+            mp->state = MULTIPART_HEADER;
+            break;
+
+        case MULTIPART_HEADER:
+            /* ignore 0x00 for %00 injection situation */
+            q = ngx_strlchr(pos, last, '\n');
+            n = (q ? q + 1 : last) - pos;
+
+            if (mp->line_len + n > YY_SEC_WAF_MULTIPART_LINE) {
+                rc = yy_sec_waf_multipart_error(ctx, "UNCOMMON_POST_FORMAT");
+                break;
+            }
+
+            ngx_memcpy(mp->line + mp->line_len, pos, n);
+            mp->line_len += n;
+            pos += n;
+
+            if (q == NULL) {
+                break;
+            }
+
+            rc = yy_sec_waf_multipart_header(r, ctx);
+            mp->line_len = 0;
+
+            if (mp->state == MULTIPART_DATA) {
+                mp->part_start = mp->offset + (pos - p);
+            }
+
+            break;
+
+        default: /* MULTIPART_EPILOGUE, MULTIPART_ERROR */
+            pos = last;
+            break;
+        }
+    }
+
+    mp->offset += len;
+
+    if (mp->state == MULTIPART_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return rc;
+}
+
+/*
+** @description: This function is called at the end of a multipart body, which
+** must have ended with the last boundary.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_multipart_finish(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    switch (ctx->multipart->state) {
+
+    case MULTIPART_EPILOGUE:
+        return NGX_OK;
+
+    case MULTIPART_ERROR:
+        return NGX_ERROR;
+
+    case MULTIPART_PREAMBLE:
+        /* no boundary at all */
+        return NGX_ERROR;
+
+    default:
+        return yy_sec_waf_multipart_error(ctx, "UNCOMMON_POST_FORMAT");
+    }
+}
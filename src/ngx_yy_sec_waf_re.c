@@ -191,25 +191,29 @@ yy_sec_waf_re_perform_interception(ngx_http_request_ctx_t *ctx)
 
     size_t  len = ctx->raw_string->len;
     u_char *p = ctx->raw_string->data;
+    char   *more = "";
 
+    /* the string may be a view of the request, it is never written to */
     if (len > NGX_MAX_ERROR_STR - 300) {
         len = NGX_MAX_ERROR_STR - 300;
-        p[len++] = '.'; p[len++] = '.'; p[len++] = '.';
+        more = "...";
     }
 
     if (ctx->action_level & ACTION_LOG) {
         ngx_log_error(NGX_LOG_ERR, ctx->r->connection->log, 0,
             "[ysec_waf] %s, id: %d,"
-            " var: %*s, client_ip: %V, server_ip: %V",
+            " var: %*s%s, client_ip: %V, server_ip: %V",
             (ctx->action_level & ACTION_BLOCK)? "block":
             (ctx->action_level & ACTION_ALLOW)? "allow": "alert",
             ctx->rule_id,
-            len, p,
+            len, p, more,
             ctx->real_client_ip, ctx->server_ip);
     }
 
-    if (ctx->action_level & ACTION_BLOCK)
+    if (ctx->action_level & ACTION_BLOCK) {
+        ngx_http_yy_sec_waf_ban_block(ctx->r);
         return yy_sec_waf_output_forbidden_page(ctx->r, ctx);
+    }
 
     return NGX_DECLINED;
 }
@@ -268,6 +272,143 @@ yy_sec_waf_re_process_block_list(ngx_http_request_t *r,
     return NGX_ERROR;
 }
 
+/*
+** @description: This function is called to get a variable of the current
+** phase. It is fetched on first use only, and then shared by all the
+** rules of the phase. A plain variable has one element, a collection has
+** one per item, and a missing variable has none.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_uint_t slot
+** @return: static ngx_http_yy_sec_waf_value_t * or NULL if failed.
+*/
+
+static ngx_http_yy_sec_waf_value_t *
+yy_sec_waf_re_phase_value(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_uint_t slot)
+{
+    ngx_str_t                    *str;
+    ngx_http_variable_value_t    *vv;
+    ngx_http_yy_sec_waf_var_t    *var;
+    ngx_http_yy_sec_waf_value_t  *value;
+
+    value = &ctx->values[slot];
+
+    if (value->elts != NULL) {
+        return value;
+    }
+
+    var = ctx->vars->elts;
+
+    if (var[slot].target.collection != COLLECTION_NONE) {
+
+        if (yy_sec_waf_re_get_collection(r, ctx, &var[slot].target, value)
+            != NGX_OK)
+        {
+            return NULL;
+        }
+
+        return value;
+    }
+
+    str = ngx_palloc(ctx->scratch_pool, sizeof(ngx_str_t));
+    if (str == NULL) {
+        return NULL;
+    }
+
+    value->elts = str;
+    value->nelts = 0;
+
+    vv = ngx_http_get_flushed_variable(r, var[slot].target.var_index);
+
+    if (vv == NULL || vv->not_found || vv->len == 0) {
+        return value;
+    }
+
+    str->data = vv->data;
+    str->len = vv->len;
+    value->nelts = 1;
+
+    return value;
+}
+
+/*
+** @description: This function is called to apply the tfns of a rule to a
+** variable of the current phase. An element is copied only when a tfn would
+** change it, and the result is shared by all the rules of the phase with
+** the same tfns on the same variable.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_rule_t *rule
+** @para: ngx_uint_t slot
+** @para: ngx_http_yy_sec_waf_value_t *value
+** @return: static ngx_http_yy_sec_waf_value_t * or NULL if failed.
+*/
+
+static ngx_http_yy_sec_waf_value_t *
+yy_sec_waf_re_phase_tfn_value(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_rule_t *rule,
+    ngx_uint_t slot, ngx_http_yy_sec_waf_value_t *value)
+{
+    u_char                       *p;
+    ngx_str_t                    *str;
+    ngx_uint_t                    i, j, n, copied;
+    re_tfns_metadata            **tfn;
+    ngx_http_yy_sec_waf_value_t  *tfn_value;
+
+    n = slot * ctx->ntfn_chains + rule->tfn_chain - 1;
+
+    tfn_value = &ctx->tfn_values[n];
+
+    if (tfn_value->elts != NULL) {
+        return tfn_value;
+    }
+
+    str = ngx_palloc(ctx->scratch_pool, (value->nelts + 1) * sizeof(ngx_str_t));
+    if (str == NULL) {
+        return NULL;
+    }
+
+    tfn = rule->tfns->elts;
+
+    for (j = 0; j < value->nelts; j++) {
+
+        str[j] = value->elts[j];
+        copied = 0;
+
+        for (i = 0; i < rule->tfns->nelts; i++) {
+
+            if (!tfn[i]->check(&str[j])) {
+                continue;
+            }
+
+            /* never write to the buffer of the variable */
+            if (!copied) {
+                p = ngx_pnalloc(ctx->scratch_pool, str[j].len);
+                if (p == NULL) {
+                    return NULL;
+                }
+
+                ctx->alloc_bytes += str[j].len;
+                ctx->copy_bytes += str[j].len;
+
+                ngx_memcpy(p, str[j].data, str[j].len);
+                str[j].data = p;
+                copied = 1;
+            }
+
+            if (tfn[i]->execute(&str[j]) != NGX_OK) {
+                return NULL;
+            }
+        }
+    }
+
+    tfn_value->elts = str;
+    tfn_value->nelts = value->nelts;
+
+    return tfn_value;
+}
+
 /*
 ** @description: This function is called to process rule for yy sec waf.
 ** @para: ngx_http_request_t *r
@@ -280,37 +421,122 @@ static ngx_int_t
 yy_sec_waf_re_process_rule(ngx_http_request_t *r,
     ngx_http_yy_sec_waf_rule_t *rule, ngx_http_request_ctx_t *ctx)
 {
-    ngx_int_t                   rc, *var_index_p;
-    ngx_uint_t                  i;
-    ngx_http_variable_value_t  *vv;
+    ngx_int_t                     rc;
+    ngx_uint_t                    i, j;
+    ngx_http_yy_sec_waf_value_t  *value;
 
 	if (rule == NULL)
 		return NGX_AGAIN;
 
-    var_index_p = rule->var_index.elts;
+    for (i = 0; i < rule->targets.nelts; i++) {
 
-    for (i = 0; i < rule->var_index.nelts; i++) {
+        value = yy_sec_waf_re_phase_value(r, ctx, rule->var_slot[i]);
 
-        vv = ngx_http_get_flushed_variable(r, var_index_p[i]);
-    
-        if (vv == NULL || vv->not_found || vv->len == 0) {
+        if (value == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (value->nelts == 0) {
             return NGX_AGAIN;
         }
 
-        ctx->var.data = vv->data;
-        ctx->var.len = vv->len;
+        if (rule->tfn_chain) {
+            value = yy_sec_waf_re_phase_tfn_value(r, ctx, rule,
+                                                  rule->var_slot[i], value);
+            if (value == NULL) {
+                return NGX_ERROR;
+            }
+        }
 
-        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] id:%d, var:%V", rule->rule_id, &ctx->var);
+        /* each element on its own, a match never spans two of them */
+        for (j = 0; j < value->nelts; j++) {
 
-        rc = yy_sec_waf_re_execute_operator(r, rule, ctx);
-        if (rc == NGX_ERROR || rc == RULE_MATCH) {
-            return rc;
+            if (value->elts[j].len == 0) {
+                continue;
+            }
+
+            ctx->var = value->elts[j];
+
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] id:%d, var:%V", rule->rule_id, &ctx->var);
+
+            rc = yy_sec_waf_re_execute_operator(r, rule, ctx);
+            if (rc == NGX_ERROR || rc == RULE_MATCH) {
+                return rc;
+            }
         }
     }
 
     return RULE_NO_MATCH;
 }
 
+/*
+** @description: This function is called to run the automatons of a phase.
+** Every variable is scanned once for all of its str: rules, and for the
+** literals of its regex: rules if regex_set is on. The rules found are
+** marked in ctx->candidates.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_phase_t *phase
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_uint_t mask
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+yy_sec_waf_re_prefilter(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_phase_t *phase, ngx_http_request_ctx_t *ctx,
+    ngx_uint_t mask)
+{
+    ngx_str_t                    *str;
+    ngx_uint_t                    i, j;
+    ngx_http_yy_sec_waf_var_t    *var;
+    ngx_http_yy_sec_waf_value_t  *value;
+
+    ctx->candidates = ngx_pcalloc(ctx->scratch_pool,
+                                  (phase->rules->nelts + 7) / 8);
+    if (ctx->candidates == NULL) {
+        return NGX_ERROR;
+    }
+
+    var = phase->vars->elts;
+
+    for (i = 0; i < phase->vars->nelts; i++) {
+
+        if (!(var[i].str_ac && (mask & PREFILTER_STR))
+            && !(var[i].regex_ac && (mask & PREFILTER_REGEX)))
+        {
+            continue;
+        }
+
+        if (ctx->body_streaming
+            && var[i].target.collection != ctx->body_streaming)
+        {
+            continue;
+        }
+
+        value = yy_sec_waf_re_phase_value(r, ctx, i);
+
+        if (value == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (j = 0; j < value->nelts; j++) {
+            str = &value->elts[j];
+
+            if (var[i].str_ac && (mask & PREFILTER_STR)) {
+                ngx_http_yy_sec_waf_ac_match(var[i].str_ac, 0, str->data,
+                                             str->len, ctx->candidates);
+            }
+
+            if (var[i].regex_ac && (mask & PREFILTER_REGEX)) {
+                ngx_http_yy_sec_waf_ac_match(var[i].regex_ac, 0, str->data,
+                                             str->len, ctx->candidates);
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
 /*
 ** @description: This function is called to process normal rules for yy sec waf.
 ** @para: ngx_http_request_t *r
@@ -323,10 +549,11 @@ ngx_int_t
 yy_sec_waf_re_process_normal_rules(ngx_http_request_t *r,
     ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx, ngx_uint_t phase)
 {
-    ngx_uint_t                  i, rule_num;
+    ngx_uint_t                  i, rule_num, mask;
     ngx_int_t                   rc, mode;
     ngx_array_t                *rule_array;
     ngx_http_yy_sec_waf_rule_t *rule;
+    ngx_http_yy_sec_waf_phase_t *phase_p;
 
 	if (ctx->cf == NULL) {
 		return NGX_ERROR;
@@ -334,25 +561,27 @@ yy_sec_waf_re_process_normal_rules(ngx_http_request_t *r,
 
     switch(phase) {
         case REQUEST_HEADER_PHASE:
-            rule_array = ctx->cf->request_header_rules;
+            phase_p = ctx->cf->request_header_phase;
             break;
         case REQUEST_BODY_PHASE:
-            rule_array = ctx->cf->request_body_rules;
+            phase_p = ctx->cf->request_body_phase;
             break;
         case RESPONSE_HEADER_PHASE:
-            rule_array = ctx->cf->response_header_rules;
+            phase_p = ctx->cf->response_header_phase;
             break;
         case RESPONSE_BODY_PHASE:
-            rule_array = ctx->cf->response_body_rules;
+            phase_p = ctx->cf->response_body_phase;
             break;
         default:
             return NGX_ERROR;
     }
 
-    if (rule_array == NULL) {
+    if (phase_p == NULL || phase_p->rules == NULL) {
         return NGX_DECLINED;
     }
 
+    rule_array = phase_p->rules;
+
 	/* If we are here that means the mode is NEXT_RULE, which
 	** then means we have done processing any chains.
 	*/
@@ -363,6 +592,39 @@ yy_sec_waf_re_process_normal_rules(ngx_http_request_t *r,
 
     ctx->phase = phase;
 
+    ctx->vars = phase_p->vars;
+    ctx->values = ngx_pcalloc(ctx->scratch_pool,
+        (phase_p->vars->nelts + 1) * sizeof(ngx_http_yy_sec_waf_value_t));
+    if (ctx->values == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->ntfn_chains = phase_p->ntfn_chains;
+
+    if (ctx->ntfn_chains) {
+        ctx->tfn_values = ngx_pcalloc(ctx->scratch_pool,
+            phase_p->vars->nelts * ctx->ntfn_chains
+            * sizeof(ngx_http_yy_sec_waf_value_t));
+        if (ctx->tfn_values == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    mask = PREFILTER_STR;
+
+    if (ctx->cf->regex_set) {
+        mask |= PREFILTER_REGEX;
+    }
+
+    mask &= phase_p->prefiltered;
+
+    if (mask) {
+        rc = yy_sec_waf_re_prefilter(r, phase_p, ctx, mask);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
     ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
         "[ysec_waf] phase: %d, rule_num: %d", phase, rule_num);
 
@@ -382,7 +644,20 @@ yy_sec_waf_re_process_normal_rules(ngx_http_request_t *r,
             continue;
         }
 
-        rc = yy_sec_waf_re_process_rule(r, &rule[i], ctx);
+        /* while streaming, only the rules of the body see the window */
+        if (ctx->body_streaming
+            && !(ctx->body_streaming == COLLECTION_REQUEST_BODY
+                 ? rule[i].request_body : rule[i].response_body))
+        {
+            rc = RULE_NO_MATCH;
+
+        } else if ((rule[i].prefiltered & mask)
+            && !(ctx->candidates[i >> 3] & (1 << (i & 7))))
+        {
+            rc = RULE_NO_MATCH;
+        } else {
+            rc = yy_sec_waf_re_process_rule(r, &rule[i], ctx);
+        }
 
         if (rc == NGX_ERROR) {
 
@@ -433,16 +708,19 @@ yy_sec_waf_re_parse_variables(ngx_conf_t *cf,
     ngx_str_t *value, ngx_http_yy_sec_waf_rule_t *rule)
 {
     ngx_str_t variable;
-    ngx_int_t len, var_index, *var_index_p;
+    ngx_int_t len;
     u_char   *start, *last, *end;
 
+    ngx_http_yy_sec_waf_target_t *target;
+
     if (value == NULL) {
         return NGX_CONF_ERROR;
     }
 
     ngx_memcpy(&variable, value, sizeof(ngx_str_t));
 
-    ngx_array_init(&rule->var_index, cf->pool, 1, sizeof(ngx_int_t));
+    ngx_array_init(&rule->targets, cf->pool, 1,
+                   sizeof(ngx_http_yy_sec_waf_target_t));
 
     len = variable.len;
     start = variable.data;
@@ -463,16 +741,41 @@ yy_sec_waf_re_parse_variables(ngx_conf_t *cf,
         variable.data = start;
         variable.len = end - start;
 
-        var_index = ngx_http_get_variable_index(cf, &variable);
-        if (var_index == NGX_ERROR) {
+        target = ngx_array_push(&rule->targets);
+        if (target == NULL)
             return NGX_CONF_ERROR;
-        }
 
-        var_index_p = ngx_array_push(&rule->var_index);
-        if (var_index_p == NULL)
-            return NGX_CONF_ERROR;
+        if (yy_sec_waf_re_resolve_collection(&variable, target) == NGX_OK) {
+            if (target->collection == COLLECTION_REQUEST_BODY) {
+                rule->request_body = 1;
+            }
 
-        *var_index_p = var_index;
+            if (target->collection == COLLECTION_RESPONSE_BODY) {
+                rule->response_body = 1;
+            }
+
+            if (target->collection == COLLECTION_JSON_ARGS
+                || target->collection == COLLECTION_JSON_ARGS_NAMES)
+            {
+                rule->need_json = 1;
+            }
+
+        } else {
+            target->var_index = ngx_http_get_variable_index(cf, &variable);
+            if (target->var_index == NGX_ERROR) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        if ((variable.len >= sizeof("ARGS") - 1
+             && ngx_strncasecmp(variable.data, (u_char *) "ARGS",
+                                sizeof("ARGS") - 1) == 0)
+            || (variable.len >= sizeof("POST_ARGS") - 1
+                && ngx_strncasecmp(variable.data, (u_char *) "POST_ARGS",
+                                   sizeof("POST_ARGS") - 1) == 0))
+        {
+            rule->need_args = 1;
+        }
 
         start = end+1;
         len = last - start;
@@ -531,6 +834,358 @@ yy_sec_waf_re_parse_operator(ngx_conf_t *cf,
     return NGX_CONF_OK;
 }
 
+/*
+** @description: This function is called to find the compiled variable of a phase.
+** @para: ngx_array_t *vars
+** @para: ngx_http_yy_sec_waf_target_t *target
+** @return: static ngx_http_yy_sec_waf_var_t * or NULL if failed.
+*/
+
+static ngx_http_yy_sec_waf_var_t *
+yy_sec_waf_re_phase_var(ngx_array_t *vars, ngx_http_yy_sec_waf_target_t *target)
+{
+    ngx_uint_t                 i;
+    ngx_http_yy_sec_waf_var_t *var;
+
+    var = vars->elts;
+
+    for (i = 0; i < vars->nelts; i++) {
+        if (var[i].target.var_index == target->var_index
+            && var[i].target.collection == target->collection
+            && var[i].target.key.len == target->key.len
+            && ngx_strncasecmp(var[i].target.key.data, target->key.data,
+                               target->key.len) == 0)
+        {
+            return &var[i];
+        }
+    }
+
+    var = ngx_array_push(vars);
+    if (var == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(var, sizeof(ngx_http_yy_sec_waf_var_t));
+    var->target = *target;
+
+    return var;
+}
+
+/*
+** @description: This function is called to add the patterns of a rule to the
+** compiled variables it targets.
+** @para: ngx_conf_t *cf
+** @para: ngx_http_yy_sec_waf_phase_t *phase
+** @para: ngx_array_t *patterns (one array per compiled variable)
+** @para: ngx_http_yy_sec_waf_rule_t *rule
+** @para: ngx_uint_t id
+** @para: ngx_str_t *str
+** @para: ngx_uint_t n
+** @return: static ngx_int_t NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+yy_sec_waf_re_compile_patterns(ngx_conf_t *cf,
+    ngx_http_yy_sec_waf_phase_t *phase, ngx_array_t *patterns,
+    ngx_http_yy_sec_waf_rule_t *rule, ngx_uint_t id, ngx_str_t *str, ngx_uint_t n)
+{
+    ngx_uint_t                        i, j, k;
+    ngx_http_yy_sec_waf_ac_pattern_t *pattern;
+
+    for (i = 0; i < rule->targets.nelts; i++) {
+
+        k = rule->var_slot[i];
+
+        if (patterns[k].elts == NULL
+            && ngx_array_init(&patterns[k], cf->temp_pool, 16,
+                              sizeof(ngx_http_yy_sec_waf_ac_pattern_t))
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        for (j = 0; j < n; j++) {
+            pattern = ngx_array_push(&patterns[k]);
+            if (pattern == NULL) {
+                return NGX_ERROR;
+            }
+
+            pattern->str = str[j];
+            pattern->id = id;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to number the tfns of a rule, so
+** that rules applying the same tfns in the same order share their results.
+** @para: ngx_http_yy_sec_waf_rule_t *rule (the rules of the phase)
+** @para: ngx_uint_t n (the rule to number, the ones before are done)
+** @return: static ngx_uint_t (1 based)
+*/
+
+static ngx_uint_t
+yy_sec_waf_re_tfn_chain(ngx_http_yy_sec_waf_rule_t *rule, ngx_uint_t n)
+{
+    ngx_uint_t  i, last;
+
+    last = 0;
+
+    for (i = 0; i < n; i++) {
+
+        if (rule[i].tfn_chain > last) {
+            last = rule[i].tfn_chain;
+        }
+
+        if (rule[i].tfns != NULL
+            && rule[i].tfns->nelts == rule[n].tfns->nelts
+            && ngx_memcmp(rule[i].tfns->elts, rule[n].tfns->elts,
+                          rule[n].tfns->nelts * sizeof(re_tfns_metadata *))
+               == 0)
+        {
+            return rule[i].tfn_chain;
+        }
+    }
+
+    return last + 1;
+}
+
+/*
+** @description: This function is called to compile the rules of one phase.
+** The variables targeted by the rules are numbered, so that each of them is
+** fetched once per phase, and so are their tfn chains. The literals of the
+** str: rules, and the required literals of the regex: rules, are grouped by
+** target variable, and automatons are built for each of them.
+** @para: ngx_conf_t *cf
+** @para: ngx_array_t *rules
+** @return: static ngx_http_yy_sec_waf_phase_t * or NULL if failed.
+*/
+
+static ngx_http_yy_sec_waf_phase_t *
+yy_sec_waf_re_compile_phase(ngx_conf_t *cf, ngx_array_t *rules)
+{
+    ngx_uint_t                        i, j, n;
+    ngx_array_t                      *str_patterns, *regex_patterns, *literals;
+    ngx_http_yy_sec_waf_var_t        *var;
+    ngx_http_yy_sec_waf_rule_t       *rule;
+    ngx_http_yy_sec_waf_phase_t      *phase, **phase_p;
+    ngx_http_yy_sec_waf_target_t     *target;
+
+    phase = ngx_pcalloc(cf->pool, sizeof(ngx_http_yy_sec_waf_phase_t));
+    if (phase == NULL) {
+        return NULL;
+    }
+
+    phase->rules = rules;
+
+    phase->vars = ngx_array_create(cf->pool, 4, sizeof(ngx_http_yy_sec_waf_var_t));
+    if (phase->vars == NULL) {
+        return NULL;
+    }
+
+    rule = rules->elts;
+
+    /* pattern arrays per compiled variable, only needed while building */
+    for (n = 0, i = 0; i < rules->nelts; i++) {
+        n += rule[i].targets.nelts;
+    }
+
+    /* every variable of the phase gets one slot, whatever its rules */
+    for (i = 0; i < rules->nelts; i++) {
+
+        phase->need_args |= rule[i].need_args;
+        phase->need_json |= rule[i].need_json;
+        phase->response_body |= rule[i].response_body;
+
+        if (rule[i].tfns != NULL) {
+            rule[i].tfn_chain = yy_sec_waf_re_tfn_chain(rule, i);
+
+            if (rule[i].tfn_chain > phase->ntfn_chains) {
+                phase->ntfn_chains = rule[i].tfn_chain;
+            }
+        }
+
+        target = rule[i].targets.elts;
+
+        rule[i].var_slot = ngx_palloc(cf->pool,
+            (rule[i].targets.nelts + 1) * sizeof(ngx_uint_t));
+        if (rule[i].var_slot == NULL) {
+            return NULL;
+        }
+
+        for (j = 0; j < rule[i].targets.nelts; j++) {
+            var = yy_sec_waf_re_phase_var(phase->vars, &target[j]);
+            if (var == NULL) {
+                return NULL;
+            }
+
+            rule[i].var_slot[j] = var - (ngx_http_yy_sec_waf_var_t *) phase->vars->elts;
+        }
+    }
+
+    str_patterns = ngx_pcalloc(cf->temp_pool, (n + 1) * sizeof(ngx_array_t));
+    regex_patterns = ngx_pcalloc(cf->temp_pool, (n + 1) * sizeof(ngx_array_t));
+
+    if (str_patterns == NULL || regex_patterns == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < rules->nelts; i++) {
+
+        /* the automatons see the variables before any tfn */
+        if (rule[i].op_negative || rule[i].targets.nelts == 0
+            || rule[i].tfns != NULL)
+        {
+            continue;
+        }
+
+        if (rule[i].str != NULL && rule[i].str->len) {
+
+            if (yy_sec_waf_re_compile_patterns(cf, phase, str_patterns,
+                    &rule[i], i, rule[i].str, 1) != NGX_OK)
+            {
+                return NULL;
+            }
+
+            rule[i].prefiltered = PREFILTER_STR;
+
+        } else if (rule[i].regex != NULL) {
+
+            literals = rule[i].regex_literals;
+            if (literals == NULL) {
+                continue;
+            }
+
+            if (yy_sec_waf_re_compile_patterns(cf, phase, regex_patterns,
+                    &rule[i], i, literals->elts, literals->nelts) != NGX_OK)
+            {
+                return NULL;
+            }
+
+            rule[i].prefiltered = PREFILTER_REGEX;
+
+        } else {
+            continue;
+        }
+
+        phase->prefiltered |= rule[i].prefiltered;
+    }
+
+    var = phase->vars->elts;
+
+    for (i = 0; i < phase->vars->nelts; i++) {
+
+        if (str_patterns[i].nelts) {
+            var[i].str_ac = ngx_http_yy_sec_waf_ac_create(cf, &str_patterns[i], 0);
+
+            if (var[i].str_ac == NULL) {
+                return NULL;
+            }
+        }
+
+        if (regex_patterns[i].nelts) {
+            var[i].regex_ac = ngx_http_yy_sec_waf_ac_create(cf, &regex_patterns[i], 1);
+
+            if (var[i].regex_ac == NULL) {
+                return NULL;
+            }
+        }
+    }
+
+    phase_p = ngx_array_push(rule_engine->phases);
+    if (phase_p == NULL) {
+        return NULL;
+    }
+
+    *phase_p = phase;
+
+    return phase;
+}
+
+/*
+** @description: This function is called to compile the rule arrays of a location.
+** A location which inherits the rules of its parent inherits the compiled
+** phases as well, so that they are built only once.
+** @para: ngx_conf_t *cf
+** @para: ngx_http_yy_sec_waf_loc_conf_t *prev
+** @para: ngx_http_yy_sec_waf_loc_conf_t *conf
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_re_compile_phases(ngx_conf_t *cf,
+    ngx_http_yy_sec_waf_loc_conf_t *prev, ngx_http_yy_sec_waf_loc_conf_t *conf)
+{
+    ngx_uint_t                     i;
+    ngx_array_t                   *rules[4], *prev_rules[4];
+    ngx_http_yy_sec_waf_phase_t  **phase[4], **prev_phase[4];
+
+    rules[0] = conf->request_header_rules;
+    rules[1] = conf->request_body_rules;
+    rules[2] = conf->response_header_rules;
+    rules[3] = conf->response_body_rules;
+
+    prev_rules[0] = prev->request_header_rules;
+    prev_rules[1] = prev->request_body_rules;
+    prev_rules[2] = prev->response_header_rules;
+    prev_rules[3] = prev->response_body_rules;
+
+    phase[0] = &conf->request_header_phase;
+    phase[1] = &conf->request_body_phase;
+    phase[2] = &conf->response_header_phase;
+    phase[3] = &conf->response_body_phase;
+
+    prev_phase[0] = &prev->request_header_phase;
+    prev_phase[1] = &prev->request_body_phase;
+    prev_phase[2] = &prev->response_header_phase;
+    prev_phase[3] = &prev->response_body_phase;
+
+    for (i = 0; i < 4; i++) {
+
+        if (rules[i] == NULL || *phase[i] != NULL) {
+            continue;
+        }
+
+        if (rules[i] == prev_rules[i]) {
+
+            if (*prev_phase[i] == NULL) {
+                *prev_phase[i] = yy_sec_waf_re_compile_phase(cf, prev_rules[i]);
+
+                if (*prev_phase[i] == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
+            *phase[i] = *prev_phase[i];
+            continue;
+        }
+
+        *phase[i] = yy_sec_waf_re_compile_phase(cf, rules[i]);
+
+        if (*phase[i] == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* the args and json are only parsed for locations with rules reading them */
+    conf->need_args = 0;
+    conf->need_json = 0;
+
+    for (i = 0; i < 4; i++) {
+        if (*phase[i] != NULL && (*phase[i])->need_args) {
+            conf->need_args = 1;
+        }
+
+        if (*phase[i] != NULL && (*phase[i])->need_json) {
+            conf->need_json = 1;
+        }
+    }
+
+    return NGX_OK;
+}
+
 /*
 ** @description: This function is called to read configuration of yy sec waf.
 ** @para: ngx_conf_t *cf
@@ -548,7 +1203,6 @@ ngx_http_yy_sec_waf_re_read_conf(ngx_conf_t *cf,
     ngx_uint_t                  n;
     char                       *rc;
     ngx_str_t                  *value, action;
-    ngx_shm_zone_t             *shm_zone;
     re_action_metadata         *action_metadata;
     ngx_http_yy_sec_waf_rule_t *rule_p, rule;
 
@@ -657,15 +1311,7 @@ ngx_http_yy_sec_waf_re_read_conf(ngx_conf_t *cf,
         ngx_memcpy(rule_p, &rule, sizeof(ngx_http_yy_sec_waf_rule_t));
     }
 
-    // Temply hack here, create shm zone for conn processor and get server_ip.
-    if (p->conn_processor) {
-        shm_zone = ngx_http_yy_sec_waf_create_shm_zone(cf);
-
-        if (shm_zone != NULL) {
-            p->shm_zone = shm_zone;
-        }
-    }
-
+    // Temply hack here, get server_ip.
     if (p->server_ip.len == 0) {
 
         p->server_ip.len = NGX_SOCKADDR_STRLEN;
@@ -835,6 +1481,12 @@ ngx_http_yy_sec_waf_re_create(ngx_conf_t *cf)
         return NGX_ERROR;
     }
 
+    rule_engine->phases = ngx_array_create(cf->pool, 4,
+        sizeof(ngx_http_yy_sec_waf_phase_t *));
+    if (rule_engine->phases == NULL) {
+        return NGX_ERROR;
+    }
+
     if (ngx_http_yy_sec_waf_add_variables(cf) == NGX_ERROR)
         return NGX_ERROR;
 
@@ -853,3 +1505,154 @@ ngx_http_yy_sec_waf_re_create(ngx_conf_t *cf)
     return NGX_OK;
 }
 
+/*
+** @description: This function is called to find the regex: rules gated by
+** their literals, one for each rule id, and so the counters they need.
+** @para: ngx_cycle_t *cycle
+** @return: the number of rule ids or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_re_count_stats(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                     i, j, k;
+    ngx_http_yy_sec_waf_rule_t    *rule, **first;
+    ngx_http_yy_sec_waf_phase_t  **phase;
+
+    if (rule_engine == NULL || rule_engine->phases == NULL) {
+        return 0;
+    }
+
+    rule_engine->stats = ngx_array_create(cycle->pool, 4,
+        sizeof(ngx_http_yy_sec_waf_rule_t *));
+    if (rule_engine->stats == NULL) {
+        return NGX_ERROR;
+    }
+
+    phase = rule_engine->phases->elts;
+
+    for (i = 0; i < rule_engine->phases->nelts; i++) {
+
+        rule = phase[i]->rules->elts;
+
+        for (j = 0; j < phase[i]->rules->nelts; j++) {
+
+            if (rule[j].regex_literals == NULL) {
+                continue;
+            }
+
+            first = rule_engine->stats->elts;
+
+            for (k = 0; k < rule_engine->stats->nelts; k++) {
+                if (first[k]->rule_id == rule[j].rule_id) {
+                    break;
+                }
+            }
+
+            if (k < rule_engine->stats->nelts) {
+                continue;
+            }
+
+            first = ngx_array_push(rule_engine->stats);
+            if (first == NULL) {
+                return NGX_ERROR;
+            }
+
+            *first = &rule[j];
+        }
+    }
+
+    return rule_engine->stats->nelts;
+}
+
+/*
+** @description: This function is called to give the regex: rules gated by
+** their literals their counters, two for each rule id, shared by the
+** workers. The rules of one id in several locations share theirs.
+** @para: ngx_atomic_t *counters
+** @return: void
+*/
+
+void
+ngx_http_yy_sec_waf_re_init_stats(ngx_atomic_t *counters)
+{
+    ngx_uint_t                     i, j, k;
+    ngx_http_yy_sec_waf_rule_t    *rule, **first;
+    ngx_http_yy_sec_waf_phase_t  **phase;
+
+    if (rule_engine == NULL || rule_engine->stats == NULL) {
+        return;
+    }
+
+    phase = rule_engine->phases->elts;
+    first = rule_engine->stats->elts;
+
+    for (i = 0; i < rule_engine->phases->nelts; i++) {
+
+        rule = phase[i]->rules->elts;
+
+        for (j = 0; j < phase[i]->rules->nelts; j++) {
+
+            if (rule[j].regex_literals == NULL) {
+                continue;
+            }
+
+            for (k = 0; first[k]->rule_id != rule[j].rule_id; k++) {
+                /* void */
+            }
+
+            rule[j].regex_stats = &counters[2 * k];
+        }
+    }
+}
+
+/*
+** @description: This function is called to get $WAF_REGEX_STATS, a line for
+** each regex: rule gated by its literals: its id, how often pcre was
+** skipped and how often the literals were checked, by all the workers.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_variable_value_t *v
+** @para: uintptr_t data
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_get_regex_stats(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                       *p;
+    ngx_uint_t                    k;
+    ngx_atomic_t                 *stats;
+    ngx_http_yy_sec_waf_rule_t  **first;
+
+    if (rule_engine == NULL || rule_engine->stats == NULL
+        || rule_engine->stats->nelts == 0)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, rule_engine->stats->nelts
+                             * (NGX_INT_T_LEN + 2 * NGX_ATOMIC_T_LEN + 3));
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = p;
+
+    first = rule_engine->stats->elts;
+
+    for (k = 0; k < rule_engine->stats->nelts; k++) {
+        stats = first[k]->regex_stats;
+
+        p = ngx_sprintf(p, "%i %uA %uA\n", first[k]->rule_id,
+                        stats[1], stats[0]);
+    }
+
+    v->len = p - v->data;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
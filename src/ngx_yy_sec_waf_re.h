@@ -46,10 +46,14 @@ typedef struct {
     fn_op_execute_t execute;
 } re_op_metadata;
 
-typedef ngx_int_t (*fn_tfns_execute_t)(ngx_http_variable_value_t *v);
+/* true if execute would change str, so that unchanged values are not copied */
+typedef ngx_flag_t (*fn_tfns_check_t)(ngx_str_t *str);
+/* transforms str in place, the result is never longer than the input */
+typedef ngx_int_t (*fn_tfns_execute_t)(ngx_str_t *str);
 
 typedef struct {
     const ngx_str_t name;
+    fn_tfns_check_t check;
     fn_tfns_execute_t execute;
 } re_tfns_metadata;
 
@@ -65,6 +69,10 @@ typedef struct {
     ngx_hash_t operators_in_hash;
     ngx_hash_t actions_in_hash;
     ngx_hash_t tfns_in_hash;
+    /* ngx_http_yy_sec_waf_phase_t *, for the statistics */
+    ngx_array_t *phases;
+    /* ngx_http_yy_sec_waf_rule_t *, the first gated regex: rule of each id */
+    ngx_array_t *stats;
 } yy_sec_waf_re_t;
 
 ngx_int_t ngx_http_yy_sec_waf_add_variables(ngx_conf_t *cf);
@@ -80,14 +88,33 @@ ngx_int_t ngx_http_yy_sec_waf_init_tfns_in_hash(ngx_conf_t *cf,
 
 re_tfns_metadata *yy_sec_waf_re_resolve_tfn_in_hash(ngx_str_t *tfn);
 
-ngx_inline void yy_sec_waf_re_cache_init_rbtree(ngx_rbtree_t *rbtree,
+ngx_int_t ngx_http_yy_sec_waf_re_compile_phases(ngx_conf_t *cf,
+    ngx_http_yy_sec_waf_loc_conf_t *prev, ngx_http_yy_sec_waf_loc_conf_t *conf);
+
+ngx_http_yy_sec_waf_ac_t *ngx_http_yy_sec_waf_ac_create(ngx_conf_t *cf,
+    ngx_array_t *patterns, ngx_uint_t caseless);
+
+ngx_uint_t ngx_http_yy_sec_waf_ac_match(ngx_http_yy_sec_waf_ac_t *ac,
+    ngx_uint_t state, u_char *p, size_t len, u_char *bitmap);
+
+ngx_array_t *ngx_http_yy_sec_waf_re_literals(ngx_conf_t *cf,
+    ngx_str_t *pattern);
+
+ngx_int_t yy_sec_waf_re_resolve_collection(ngx_str_t *name,
+    ngx_http_yy_sec_waf_target_t *target);
+
+ngx_int_t yy_sec_waf_re_get_collection(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_target_t *target,
+    ngx_http_yy_sec_waf_value_t *value);
+
+void yy_sec_waf_re_cache_init_rbtree(ngx_rbtree_t *rbtree,
     ngx_rbtree_node_t *sentinel);
 
-ngx_int_t yy_sec_waf_re_cache_set_value(ngx_pool_t *pool,
-    ngx_str_t *name, ngx_array_t *value, ngx_rbtree_t *rbtree);
+ngx_int_t yy_sec_waf_re_cache_set_value(ngx_http_request_ctx_t *ctx,
+    ngx_str_t *name, ngx_http_variable_value_t *value);
 
-ngx_inline ngx_str_t *yy_sec_waf_re_cache_get_value(ngx_rbtree_t *rbtree,
-    ngx_str_t *name);
+ngx_http_variable_value_t *yy_sec_waf_re_cache_get_value(
+    ngx_http_request_ctx_t *ctx, ngx_str_t *name);
 
 #endif
 
@@ -0,0 +1,190 @@
+#include "ngx_yy_sec_waf_re.h"
+
+/*
+** @description: This function is called to build an Aho-Corasick automaton.
+** The goto and failure functions are folded into one dense transition table
+** over byte classes, so matching costs a single lookup per input byte no
+** matter how many patterns are compiled in.
+** @para: ngx_conf_t *cf
+** @para: ngx_array_t *patterns (ngx_http_yy_sec_waf_ac_pattern_t)
+** @para: ngx_uint_t caseless
+** @return: ngx_http_yy_sec_waf_ac_t * or NULL if failed.
+*/
+
+ngx_http_yy_sec_waf_ac_t *
+ngx_http_yy_sec_waf_ac_create(ngx_conf_t *cf,
+    ngx_array_t *patterns, ngx_uint_t caseless)
+{
+    u_char                            c;
+    size_t                            i;
+    uint32_t                          s, t, f, k, max_states, nstates;
+    uint32_t                         *delta, *fail, *out, *dict, *next, *queue;
+    ngx_uint_t                        n, head, tail, nclasses;
+    ngx_http_yy_sec_waf_ac_t         *ac;
+    ngx_http_yy_sec_waf_ac_pattern_t *pattern;
+
+    if (patterns == NULL || patterns->nelts == 0) {
+        return NULL;
+    }
+
+    ac = ngx_pcalloc(cf->pool, sizeof(ngx_http_yy_sec_waf_ac_t));
+    if (ac == NULL) {
+        return NULL;
+    }
+
+    pattern = patterns->elts;
+
+    /* class 0 stands for every byte which appears in no pattern */
+    nclasses = 1;
+    max_states = 1;
+
+    for (n = 0; n < patterns->nelts; n++) {
+        for (i = 0; i < pattern[n].str.len; i++) {
+            c = pattern[n].str.data[i];
+
+            if (caseless) {
+                c = ngx_tolower(c);
+            }
+
+            if (ac->classes[c] == 0) {
+                ac->classes[c] = (uint16_t) nclasses++;
+            }
+        }
+
+        max_states += pattern[n].str.len;
+    }
+
+    if (caseless) {
+        for (c = 'A'; c <= 'Z'; c++) {
+            ac->classes[c] = ac->classes[c | 0x20];
+        }
+    }
+
+    delta = ngx_pcalloc(cf->temp_pool,
+                        (size_t) max_states * nclasses * sizeof(uint32_t));
+    fail = ngx_pcalloc(cf->temp_pool, max_states * sizeof(uint32_t));
+    out = ngx_pcalloc(cf->temp_pool, max_states * sizeof(uint32_t));
+    queue = ngx_palloc(cf->temp_pool, max_states * sizeof(uint32_t));
+
+    next = ngx_pcalloc(cf->pool, patterns->nelts * sizeof(uint32_t));
+    ac->ids = ngx_palloc(cf->pool, patterns->nelts * sizeof(ngx_uint_t));
+
+    if (delta == NULL || fail == NULL || out == NULL || queue == NULL
+        || next == NULL || ac->ids == NULL)
+    {
+        return NULL;
+    }
+
+    /* trie, patterns ending in the same state are linked through next[] */
+    nstates = 1;
+
+    for (n = 0; n < patterns->nelts; n++) {
+        s = 0;
+
+        for (i = 0; i < pattern[n].str.len; i++) {
+            c = pattern[n].str.data[i];
+            t = delta[s * nclasses + ac->classes[c]];
+
+            if (t == 0) {
+                t = nstates++;
+                delta[s * nclasses + ac->classes[c]] = t;
+            }
+
+            s = t;
+        }
+
+        ac->ids[n] = pattern[n].id;
+        next[n] = out[s];
+        out[s] = (uint32_t) n + 1;
+    }
+
+    /* breadth first, so the row of fail[s] is always complete */
+    dict = ngx_pcalloc(cf->pool, nstates * sizeof(uint32_t));
+    if (dict == NULL) {
+        return NULL;
+    }
+
+    head = tail = 0;
+    queue[tail++] = 0;
+
+    while (head < tail) {
+        s = queue[head++];
+
+        for (k = 0; k < nclasses; k++) {
+            t = delta[s * nclasses + k];
+
+            if (t == 0) {
+                if (s != 0) {
+                    delta[s * nclasses + k] = delta[fail[s] * nclasses + k];
+                }
+
+                continue;
+            }
+
+            f = (s == 0) ? 0 : delta[fail[s] * nclasses + k];
+
+            fail[t] = f;
+            dict[t] = out[f] ? f : dict[f];
+
+            queue[tail++] = t;
+        }
+    }
+
+    ac->nclasses = nclasses;
+    ac->nstates = nstates;
+    ac->next = next;
+    ac->dict = dict;
+
+    ac->delta = ngx_palloc(cf->pool, (size_t) nstates * nclasses * sizeof(uint32_t));
+    ac->out = ngx_palloc(cf->pool, nstates * sizeof(uint32_t));
+
+    if (ac->delta == NULL || ac->out == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(ac->delta, delta, (size_t) nstates * nclasses * sizeof(uint32_t));
+    ngx_memcpy(ac->out, out, nstates * sizeof(uint32_t));
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+        "[ysec_waf] ac: %ui patterns, %ui states, %ui classes",
+        patterns->nelts, (ngx_uint_t) nstates, nclasses);
+
+    return ac;
+}
+
+/*
+** @description: This function is called to run an automaton over a buffer.
+** The id of every pattern found is set in the bitmap, and the final state is
+** returned so that a caller may continue the scan with the next buffer.
+** @para: ngx_http_yy_sec_waf_ac_t *ac
+** @para: ngx_uint_t state
+** @para: u_char *p
+** @para: size_t len
+** @para: u_char *bitmap
+** @return: ngx_uint_t
+*/
+
+ngx_uint_t
+ngx_http_yy_sec_waf_ac_match(ngx_http_yy_sec_waf_ac_t *ac, ngx_uint_t state,
+    u_char *p, size_t len, u_char *bitmap)
+{
+    u_char     *last;
+    uint32_t    s, t, k;
+    ngx_uint_t  id;
+
+    s = (uint32_t) state;
+    last = p + len;
+
+    while (p < last) {
+        s = ac->delta[s * ac->nclasses + ac->classes[*p++]];
+
+        for (t = ac->out[s] ? s : ac->dict[s]; t; t = ac->dict[t]) {
+            for (k = ac->out[t]; k; k = ac->next[k - 1]) {
+                id = ac->ids[k - 1];
+                bitmap[id >> 3] |= (u_char) (1 << (id & 7));
+            }
+        }
+    }
+
+    return s;
+}
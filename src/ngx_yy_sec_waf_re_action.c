@@ -186,19 +186,31 @@ static void *
 yy_sec_waf_parse_tfn(ngx_conf_t *cf,
     ngx_str_t *tmp, ngx_http_yy_sec_waf_rule_t *rule)
 {
-    ngx_str_t *tfn;
+    ngx_str_t          tfn;
+    re_tfns_metadata **metadata;
 
     if (!rule)
         return NGX_CONF_ERROR;
 
-    tfn = ngx_pcalloc(cf->pool, sizeof(ngx_str_t));
-    if (!tfn)
-        return NGX_CONF_ERROR;
+    tfn.data = tmp->data + ngx_strlen(TFNS);
+    tfn.len = tmp->len - ngx_strlen(TFNS);
 
-    tfn->data = tmp->data + ngx_strlen(TFNS);
-    tfn->len = tmp->len - ngx_strlen(TFNS);
+    /* t: may be given more than once, the tfns are applied in order */
+    if (rule->tfns == NULL) {
+        rule->tfns = ngx_array_create(cf->pool, 2, sizeof(re_tfns_metadata *));
+        if (rule->tfns == NULL)
+            return NGX_CONF_ERROR;
+    }
 
-    rule->tfn_metadata = yy_sec_waf_re_resolve_tfn_in_hash(tfn);
+    metadata = ngx_array_push(rule->tfns);
+    if (metadata == NULL)
+        return NGX_CONF_ERROR;
+
+    *metadata = yy_sec_waf_re_resolve_tfn_in_hash(&tfn);
+    if (*metadata == NULL) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "[ysec_waf] unknown tfn '%V'", &tfn);
+        return NGX_CONF_ERROR;
+    }
 
     return NGX_CONF_OK;
 }
@@ -1,75 +1,91 @@
 #include "ngx_yy_sec_waf_re.h"
 
 typedef struct {
-    ngx_str_node_t sn;
-    ngx_array_t   *value;
+    ngx_str_node_t             sn;
+    ngx_http_variable_value_t  value;
 } re_cache_node_t;
 
-ngx_inline void
+/*
+** @description: This function is called to init the variable cache of a request.
+** @para: ngx_rbtree_t *rbtree
+** @para: ngx_rbtree_node_t *sentinel
+** @return: void
+*/
+
+void
 yy_sec_waf_re_cache_init_rbtree(ngx_rbtree_t *rbtree,
-    ngx_rbtree_node_t *sentinel) 
+    ngx_rbtree_node_t *sentinel)
 {
     ngx_rbtree_init(rbtree, sentinel, ngx_str_rbtree_insert_value);
 }
 
+/*
+** @description: This function is called to remember the value of a variable
+** for the rest of the request. The name is not copied, it must live as
+** long as the request.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_str_t *name
+** @para: ngx_http_variable_value_t *value
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
 ngx_int_t
-yy_sec_waf_re_cache_set_value(ngx_pool_t *pool,
-    ngx_str_t *name, ngx_array_t *value, ngx_rbtree_t *rbtree)
+yy_sec_waf_re_cache_set_value(ngx_http_request_ctx_t *ctx,
+    ngx_str_t *name, ngx_http_variable_value_t *value)
 {
     uint32_t         hash;
-    ngx_str_t       *val;
     re_cache_node_t *cache_node;
 
     hash = ngx_crc32_long(name->data, name->len);
 
-    cache_node = (re_cache_node_t *) ngx_str_rbtree_lookup(rbtree, name, hash);
+    cache_node = (re_cache_node_t *) ngx_str_rbtree_lookup(&ctx->cache_rbtree,
+                                                           name, hash);
 
     if (cache_node != NULL) {
+        cache_node->value = *value;
         return NGX_OK;
     }
 
-    cache_node = ngx_palloc(pool, sizeof(re_cache_node_t));
+    cache_node = ngx_palloc(ctx->pool, sizeof(re_cache_node_t));
 
     if (cache_node == NULL) {
         return NGX_ERROR;
     }
 
-    val = ngx_palloc(pool, sizeof(ngx_str_t));
-
-    if (value == NULL) {
-        return NGX_ERROR;
-    }
-
-    val->len = value->len;
-    val->data = ngx_pstrdup(pool, value);
-    if (val->data == NULL) {
-        return NGX_ERROR;
-    }
+    ctx->alloc_bytes += sizeof(re_cache_node_t);
 
     cache_node->sn.node.key = hash;
     cache_node->sn.str.len = name->len;
     cache_node->sn.str.data = name->data;
-    cache_node->value = value;
+    cache_node->value = *value;
 
-    ngx_rbtree_insert(rbtree, &cache_node->sn.node);
+    ngx_rbtree_insert(&ctx->cache_rbtree, &cache_node->sn.node);
 
     return NGX_OK;
 }
 
-ngx_inline ngx_array_t *
-yy_sec_waf_re_cache_get_value(ngx_rbtree_t *rbtree, ngx_str_t *name)
+/*
+** @description: This function is called to look up the value of a variable
+** computed earlier in the request.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_str_t *name
+** @return: ngx_http_variable_value_t * or NULL if not cached.
+*/
+
+ngx_http_variable_value_t *
+yy_sec_waf_re_cache_get_value(ngx_http_request_ctx_t *ctx, ngx_str_t *name)
 {
     uint32_t         hash;
     re_cache_node_t *cache_node;
 
     hash = ngx_crc32_long(name->data, name->len);
 
-    cache_node = (re_cache_node_t *) ngx_str_rbtree_lookup(rbtree, name, hash);
+    cache_node = (re_cache_node_t *) ngx_str_rbtree_lookup(&ctx->cache_rbtree,
+                                                           name, hash);
 
     if (cache_node != NULL) {
-        return cache_node->value;
+        return &cache_node->value;
     }
 
     return NULL;
 }
-
@@ -0,0 +1,415 @@
+#include "ngx_yy_sec_waf_re.h"
+
+/*
+** @description: This function is called to skip a parenthesized group or a
+** character class of a regex.
+** @para: u_char *p (points to the opening '(' or '[')
+** @para: u_char *last
+** @return: static u_char * (past the closing char) or NULL if unbalanced.
+*/
+
+static u_char *
+yy_sec_waf_re_literal_skip(u_char *p, u_char *last)
+{
+    ngx_uint_t  depth, in_class;
+
+    depth = 0;
+    in_class = 0;
+
+    while (p < last) {
+
+        if (*p == '\\') {
+            p += 2;
+            continue;
+        }
+
+        if (in_class) {
+            if (*p == '[' && p + 1 < last && p[1] == ':') {
+                /* posix class, [:alpha:] */
+                p = ngx_strlchr(p + 2, last, ']');
+                if (p == NULL) {
+                    return NULL;
+                }
+
+            } else if (*p == ']') {
+                in_class = 0;
+
+                if (depth == 0) {
+                    return p + 1;
+                }
+            }
+
+            p++;
+            continue;
+        }
+
+        if (*p == '[') {
+            in_class = 1;
+            p++;
+
+            /* a leading ']' is a member, not the end of the class */
+            if (p < last && *p == '^') {
+                p++;
+            }
+
+            if (p < last && *p == ']') {
+                p++;
+            }
+
+            continue;
+        }
+
+        if (*p == '(') {
+            depth++;
+
+        } else if (*p == ')') {
+            if (depth-- == 1) {
+                return p + 1;
+            }
+        }
+
+        p++;
+    }
+
+    return NULL;
+}
+
+/*
+** @description: This function is called to skip the arguments of an escape
+** sequence whose letter is alphanumeric, like \x41, \p{L} or \k<name>.
+** @para: u_char c (the escaped char)
+** @para: u_char *p (points past the escaped char)
+** @para: u_char *last
+** @return: static u_char *
+*/
+
+static u_char *
+yy_sec_waf_re_literal_skip_escape(u_char c, u_char *p, u_char *last)
+{
+    u_char      *q;
+    ngx_uint_t   n;
+
+    if (p < last && *p == '{') {
+        q = ngx_strlchr(p, last, '}');
+        return q ? q + 1 : last;
+    }
+
+    switch (c) {
+
+    case 'x':
+        for (n = 0; n < 2 && p < last; n++, p++) {
+            c = (u_char) (*p | 0x20);
+
+            if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+                break;
+            }
+        }
+        break;
+
+    case 'c':
+    case 'p':
+    case 'P':
+        if (p < last) {
+            p++;
+        }
+        break;
+
+    case 'g':
+    case 'k':
+        if (p < last && (*p == '<' || *p == '\'')) {
+            q = ngx_strlchr(p + 1, last, (u_char) (*p == '<' ? '>' : '\''));
+            return q ? q + 1 : last;
+        }
+
+        /* fall through */
+
+    default:
+        while (p < last && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    return p;
+}
+
+/*
+** @description: This function is called to parse a quantifier.
+** @para: u_char *p
+** @para: u_char *last
+** @para: ngx_uint_t *min (minimum repetitions)
+** @return: static u_char * (past the quantifier) or p if there is none.
+*/
+
+static u_char *
+yy_sec_waf_re_literal_quantifier(u_char *p, u_char *last, ngx_uint_t *min)
+{
+    u_char  *q;
+
+    if (p >= last) {
+        return p;
+    }
+
+    switch (*p) {
+
+    case '*':
+    case '?':
+        *min = 0;
+        q = p + 1;
+        break;
+
+    case '+':
+        *min = 1;
+        q = p + 1;
+        break;
+
+    case '{':
+        /* only {n}, {n,} and {n,m} are quantifiers, anything else is literal */
+        q = p + 1;
+        *min = 0;
+
+        if (q >= last || *q < '0' || *q > '9') {
+            return p;
+        }
+
+        while (q < last && *q >= '0' && *q <= '9') {
+            *min = *min * 10 + (*q++ - '0');
+        }
+
+        if (q < last && *q == ',') {
+            q++;
+
+            while (q < last && *q >= '0' && *q <= '9') {
+                q++;
+            }
+        }
+
+        if (q >= last || *q != '}') {
+            return p;
+        }
+
+        q++;
+        break;
+
+    default:
+        return p;
+    }
+
+    /* lazy and possessive forms */
+    if (q < last && (*q == '?' || *q == '+')) {
+        q++;
+    }
+
+    return q;
+}
+
+/*
+** @description: This function is called to find the longest literal which
+** must appear in every match of one branch of a regex.
+** @para: u_char *p
+** @para: u_char *last
+** @para: u_char *buf (scratch, at least last - p bytes)
+** @para: ngx_str_t *best
+** @return: static ngx_int_t NGX_OK, or NGX_DECLINED if no literal can be proven.
+*/
+
+static ngx_int_t
+yy_sec_waf_re_literal_branch(u_char *p, u_char *last, u_char *buf,
+    ngx_str_t *best)
+{
+    u_char      c, *run, *q;
+    size_t      len;
+    ngx_uint_t  min, literal;
+
+    best->len = 0;
+    best->data = NULL;
+
+    run = buf;
+    len = 0;
+
+    while (p < last) {
+
+        literal = 0;
+        c = *p;
+
+        switch (c) {
+
+        case '\\':
+            if (p + 1 >= last) {
+                return NGX_DECLINED;
+            }
+
+            c = p[1];
+            p += 2;
+
+            if (c == 'Q' || c == 'E') {
+                /* quoting would need its own parser, do not gate */
+                return NGX_DECLINED;
+            }
+
+            if ((c >= '0' && c <= '9')
+                || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z'))
+            {
+                p = yy_sec_waf_re_literal_skip_escape(c, p, last);
+
+            } else {
+                literal = 1;
+            }
+
+            break;
+
+        case '[':
+        case '(':
+            q = yy_sec_waf_re_literal_skip(p, last);
+            if (q == NULL) {
+                return NGX_DECLINED;
+            }
+
+            p = q;
+            break;
+
+        case ')':
+        case '*':
+        case '+':
+        case '?':
+            /* unbalanced or dangling, leave it to pcre */
+            return NGX_DECLINED;
+
+        case '.':
+        case '^':
+        case '$':
+            p++;
+            break;
+
+        default:
+            literal = 1;
+            p++;
+        }
+
+        q = yy_sec_waf_re_literal_quantifier(p, last, &min);
+
+        if (literal && (q == p || min > 0)) {
+            run[len++] = ngx_tolower(c);
+        }
+
+        if (literal && q == p) {
+            continue;
+        }
+
+        /* the run ends at anything which is not a single required char */
+        if (len > best->len) {
+            best->data = run;
+            best->len = len;
+            run += len;
+        }
+
+        len = 0;
+        p = q;
+    }
+
+    if (len > best->len) {
+        best->data = run;
+        best->len = len;
+    }
+
+    return best->len ? NGX_OK : NGX_DECLINED;
+}
+
+/*
+** @description: This function is called to extract the required literals of
+** a regex, so that it can be skipped when none of them is in the subject.
+** Each top level alternative contributes its longest literal, and a match
+** implies that at least one of them is present. The literals are lowercased,
+** the regexes are compiled with PCRE_CASELESS.
+** @para: ngx_conf_t *cf
+** @para: ngx_str_t *pattern
+** @return: ngx_array_t * (ngx_str_t) or NULL if no literal can be proven.
+*/
+
+ngx_array_t *
+ngx_http_yy_sec_waf_re_literals(ngx_conf_t *cf, ngx_str_t *pattern)
+{
+    u_char       *p, *q, *last, *buf;
+    ngx_str_t     best, *literal;
+    ngx_array_t  *literals;
+
+    if (pattern == NULL || pattern->len == 0) {
+        return NULL;
+    }
+
+    p = pattern->data;
+    last = pattern->data + pattern->len;
+
+    /* extended mode, (?x) or (?ix: and the like, makes whitespace insignificant */
+    while ((p = ngx_strlchr(p, last, '(')) != NULL) {
+
+        if (++p < last && *p == '?') {
+            for (q = p + 1; q < last; q++) {
+                if (*q == 'x') {
+                    return NULL;
+                }
+
+                if (*q != '-' && ((*q | 0x20) < 'a' || (*q | 0x20) > 'z')) {
+                    break;
+                }
+            }
+        }
+    }
+
+    buf = ngx_pnalloc(cf->temp_pool, pattern->len);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    literals = ngx_array_create(cf->pool, 1, sizeof(ngx_str_t));
+    if (literals == NULL) {
+        return NULL;
+    }
+
+    p = pattern->data;
+    last = pattern->data + pattern->len;
+
+    while (p <= last) {
+
+        /* find the end of this top level alternative */
+        for (q = p; q < last && *q != '|'; ) {
+
+            if (*q == '\\') {
+                q += 2;
+
+            } else if (*q == '[' || *q == '(') {
+                q = yy_sec_waf_re_literal_skip(q, last);
+                if (q == NULL) {
+                    return NULL;
+                }
+
+            } else {
+                q++;
+            }
+        }
+
+        if (q > last) {
+            return NULL;
+        }
+
+        if (yy_sec_waf_re_literal_branch(p, q, buf, &best) != NGX_OK) {
+            return NULL;
+        }
+
+        literal = ngx_array_push(literals);
+        if (literal == NULL) {
+            return NULL;
+        }
+
+        literal->len = best.len;
+        literal->data = ngx_pnalloc(cf->pool, best.len);
+        if (literal->data == NULL) {
+            return NULL;
+        }
+
+        ngx_memcpy(literal->data, best.data, best.len);
+
+        p = q + 1;
+    }
+
+    return literals;
+}
@@ -47,7 +47,9 @@ yy_sec_waf_execute_str(ngx_http_request_t *r,
 
     if (rule->str != NULL) {
         /* STR */
-        if (ngx_strnstr(str->data, (char*) rule->str->data, str->len)) {
+        if (ngx_yy_sec_waf_memmem(str->data, str->len,
+                rule->str->data, rule->str->len))
+        {
             return RULE_MATCH;
         }
     }
@@ -87,6 +89,9 @@ yy_sec_waf_parse_regex(ngx_conf_t *cf,
     if (rule->regex == NULL)
         return NGX_CONF_ERROR;
 
+    /* NULL if no literal is required, then pcre always runs */
+    rule->regex_literals = ngx_http_yy_sec_waf_re_literals(cf, &pattern);
+
     return NGX_CONF_OK;
 }
 
@@ -102,12 +107,38 @@ static ngx_int_t
 yy_sec_waf_execute_regex(ngx_http_request_t *r,
     ngx_str_t *str, ngx_http_yy_sec_waf_rule_t *rule)
 {
-    int rc;
+    int         rc;
+    ngx_str_t  *literal;
+    ngx_uint_t  i;
 
     if (str == NULL || str->data == NULL) {
         return NGX_ERROR;
     }
 
+    if (rule->regex_literals != NULL) {
+        if (rule->regex_stats != NULL) {
+            ngx_atomic_fetch_add(&rule->regex_stats[0], 1);
+        }
+
+        literal = rule->regex_literals->elts;
+
+        for (i = 0; i < rule->regex_literals->nelts; i++) {
+            if (ngx_strlcasestrn(str->data, str->data + str->len,
+                    literal[i].data, literal[i].len - 1) != NULL)
+            {
+                break;
+            }
+        }
+
+        if (i == rule->regex_literals->nelts) {
+            if (rule->regex_stats != NULL) {
+                ngx_atomic_fetch_add(&rule->regex_stats[1], 1);
+            }
+
+            return RULE_NO_MATCH;
+        }
+    }
+
     if (rule->regex != NULL) {
         /* REGEX */
         rc = ngx_http_regex_exec(r, rule->regex, str);
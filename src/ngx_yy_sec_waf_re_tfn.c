@@ -1,30 +1,40 @@
 #include "ngx_yy_sec_waf_re.h"
 
+/*
+** @description: This function is called to check whether urldecode would
+** change a value, that is whether it holds a '%' or a '+'.
+** @para: ngx_str_t *str
+** @return: static ngx_flag_t
+*/
+
+static ngx_flag_t
+yy_sec_waf_re_tfns_urldecode_check(ngx_str_t *str)
+{
+    return ngx_yy_sec_waf_plain_len(str->data, str->len) != str->len;
+}
+
 /*
 ** @description: This function is called to excute urldecode tfs.
-** @para: ngx_http_variable_value_t *v
-** @return: RULE_MATCH or RULE_NO_MATCH if failed.
+** @para: ngx_str_t *str
+** @return: NGX_OK or NGX_ERROR if failed.
 */
 
 static ngx_int_t
-yy_sec_waf_re_tfns_urldecode(ngx_http_variable_value_t *v)
+yy_sec_waf_re_tfns_urldecode(ngx_str_t *str)
 {
-    if (v == NULL) {
+    if (str == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_str_t str;
-    str.data = v->data;
-    str.len = v->len;
-
-    ngx_yy_sec_waf_unescape(&str);
+    ngx_yy_sec_waf_unescape(str);
 
     return NGX_OK;
 }
 
 static re_tfns_metadata tfns_metadata[] = {
-    { ngx_string("urldecode"), yy_sec_waf_re_tfns_urldecode },
-    { ngx_null_string, NULL }
+    { ngx_string("urldecode"), yy_sec_waf_re_tfns_urldecode_check,
+      yy_sec_waf_re_tfns_urldecode },
+    { ngx_null_string, NULL, NULL }
 };
 
 /*
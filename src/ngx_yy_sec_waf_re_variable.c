@@ -1,7 +1,48 @@
 #include "ngx_yy_sec_waf_re.h"
 
+static ngx_str_t  yy_sec_waf_args_name = ngx_string("ARGS");
+static ngx_str_t  yy_sec_waf_multipart_name_name = ngx_string("MULTIPART_NAME");
+static ngx_str_t  yy_sec_waf_multipart_filename_name =
+    ngx_string("MULTIPART_FILENAME");
+static ngx_str_t  yy_sec_waf_multipart_content_type_name =
+    ngx_string("MULTIPART_CONTENT_TYPE");
+
+/*
+** @description: This function is called to decode the values of the args
+** from one source, joined by '$'.
+** @para: u_char *p
+** @para: ngx_array_t *args
+** @para: ngx_uint_t flag
+** @return: u_char * (past the last value)
+*/
+
+static u_char *
+yy_sec_waf_join_args(u_char *p, ngx_array_t *args, ngx_uint_t flag)
+{
+    ngx_uint_t                 i, n;
+    ngx_http_yy_sec_waf_arg_t *arg;
+
+    arg = args->elts;
+
+    for (i = 0, n = 0; i < args->nelts; i++) {
+        if (arg[i].flag != flag) {
+            continue;
+        }
+
+        if (n++) {
+            *p++ = '$';
+        }
+
+        p = ngx_http_yy_sec_waf_decode_arg(p, &arg[i].value);
+    }
+
+    return p;
+}
+
 /*
 ** @description: This function is called to get args.
+** ARGS and ARGS_POST are decoded from the recorded offsets once per request
+** and kept in the cache. A lone value which needs no decoding is not copied.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_variable_value_t *v
 ** @para: uintptr_t data
@@ -12,8 +53,12 @@ static ngx_int_t
 yy_sec_waf_get_args(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
+    u_char                    *p, *start;
+    size_t                     len;
+    ngx_uint_t                 i, get, post;
     ngx_http_request_ctx_t    *ctx;
-    ngx_str_t                  p;
+    ngx_http_variable_value_t *cached;
+    ngx_http_yy_sec_waf_arg_t *arg;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
 
@@ -22,35 +67,38 @@ yy_sec_waf_get_args(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    if (ctx->args.len == 0 && ctx->post_args.len == 0){
-        v->not_found = 1;
-        return NGX_OK;
+    if (r->method == NGX_HTTP_POST && ctx->full_body != NULL) {
+        
+        ctx->raw_string = ctx->full_body;
+    } else if (r->method == NGX_HTTP_GET || r->method == NGX_HTTP_POST) {
+    
+        ctx->raw_string = &r->args;
     }
 
-    v->data = ctx->args.data;
-    v->len = ctx->args.len;
+    cached = yy_sec_waf_re_cache_get_value(ctx, &yy_sec_waf_args_name);
 
-    if (ctx->post_args.len) {
-        p.len = ctx->args.len+ctx->post_args.len+1;
-        p.data = ngx_palloc(r->pool, p.len);
-        if (p.data == NULL) {
-            return NGX_ERROR;
-        }
-
-        v->data = p.data;
-        v->len = p.len;
+    if (cached != NULL) {
+        *v = *cached;
+        return NGX_OK;
+    }
 
-        p.data = ngx_cpymem(p.data, ctx->args.data, ctx->args.len);
-        p.data = ngx_cpymem(p.data, ",", 1);
-        ngx_memcpy(p.data, ctx->post_args.data, ctx->post_args.len);
+    if (ctx->args.nelts == 0) {
+        v->not_found = 1;
+        return yy_sec_waf_re_cache_set_value(ctx, &yy_sec_waf_args_name, v);
     }
 
-    if (r->method == NGX_HTTP_POST) {
-        
-        ctx->raw_string = ctx->full_body;
-    } else if (r->method == NGX_HTTP_GET) {
-    
-        ctx->raw_string = &r->args;
+    arg = ctx->args.elts;
+    get = post = 0;
+    len = 0;
+
+    for (i = 0; i < ctx->args.nelts; i++) {
+        if (arg[i].flag == PROCESS_ARGS_POST) {
+            post++;
+        } else {
+            get++;
+        }
+
+        len += arg[i].value.len + 1;
     }
 
     v->valid = 1;
@@ -58,7 +106,41 @@ yy_sec_waf_get_args(ngx_http_request_t *r,
     v->escape = 0;
     v->not_found = 0;
 
-    return NGX_OK;
+    /* the request line can not hold CR, LF or NUL, nothing to convert */
+
+    if (get + post == 1 && arg[0].flag == PROCESS_ARGS
+        && ngx_yy_sec_waf_plain_len(arg[0].value.data, arg[0].value.len)
+           == arg[0].value.len)
+    {
+        v->data = arg[0].value.data;
+        v->len = arg[0].value.len;
+
+        return yy_sec_waf_re_cache_set_value(ctx, &yy_sec_waf_args_name, v);
+    }
+
+    /* GET values joined by '$', then ',' and the POST values likewise */
+
+    start = p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->alloc_bytes += len;
+    ctx->copy_bytes += len;
+
+    p = yy_sec_waf_join_args(p, &ctx->args, PROCESS_ARGS);
+
+    if (post) {
+        *p++ = ',';
+        p = yy_sec_waf_join_args(p, &ctx->args, PROCESS_ARGS_POST);
+    }
+
+    ngx_yy_sec_waf_crlf_to_space(start, p - start, 1);
+
+    v->data = start;
+    v->len = p - start;
+
+    return yy_sec_waf_re_cache_set_value(ctx, &yy_sec_waf_args_name, v);
 }
 
 /*
@@ -100,6 +182,43 @@ yy_sec_waf_get_post_args_count(ngx_http_request_t *r,
     return NGX_OK;
 }
 
+/*
+** @description: This function is called to get the count of GET and POST args.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_variable_value_t *v
+** @para: uintptr_t data
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+yy_sec_waf_get_args_count(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                    *p;
+    ngx_http_request_ctx_t    *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
+
+    if (ctx == NULL || ctx->args.nelts == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_yy_sec_waf_uitoa(r->pool, ctx->args.nelts);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_strlen(p);
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->escape = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
 /*
 ** @description: This function is called to get process body error.
 ** @para: ngx_http_request_t *r
@@ -131,21 +250,26 @@ yy_sec_waf_get_process_body_error(ngx_http_request_t *r,
 }
 
 /*
-** @description: This function is called to get multipart name.
+** @description: This function is called to concatenate the parts of a
+** multipart variable. The result is built once per request and kept in
+** the cache.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_variable_value_t *v
-** @para: uintptr_t data
+** @para: ngx_str_t *name
+** @para: ngx_array_t *parts
 ** @return: NGX_OK or NGX_ERROR if failed.
 */
 
 static ngx_int_t
-yy_sec_waf_get_multipart_name(ngx_http_request_t *r,
-    ngx_http_variable_value_t *v, uintptr_t data)
+yy_sec_waf_get_multipart(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, ngx_str_t *name, ngx_array_t *parts)
 {
+    size_t                     len;
     ngx_uint_t                 i;
     ngx_str_t                 *var;
     u_char                    *p;
     ngx_http_request_ctx_t    *ctx;
+    ngx_http_variable_value_t *cached;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
 
@@ -154,36 +278,50 @@ yy_sec_waf_get_multipart_name(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    var = ctx->multipart_name.elts;
+    cached = yy_sec_waf_re_cache_get_value(ctx, name);
 
-    for (i = 0; i < ctx->multipart_name.nelts; i++) {
-        v->len += var[i].len;
+    if (cached != NULL) {
+        *v = *cached;
+        return NGX_OK;
     }
 
-    if (v->len == 0) {
+    var = parts->elts;
+    len = 0;
+
+    for (i = 0; i < parts->nelts; i++) {
+        len += var[i].len;
+    }
+
+    if (len == 0) {
         v->not_found = 1;
-        return NGX_OK;
+        return yy_sec_waf_re_cache_set_value(ctx, name, v);
     }
 
-    v->data = ngx_palloc(r->pool, v->len);
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->alloc_bytes += len;
+    ctx->copy_bytes += len;
 
-    p = v->data;
+    v->data = p;
+    v->len = len;
 
-    for (i = 0; i < ctx->multipart_name.nelts; i++) {
-        v->data = ngx_cpymem(v->data, var[i].data, var[i].len);
+    for (i = 0; i < parts->nelts; i++) {
+        p = ngx_cpymem(p, var[i].data, var[i].len);
     }
 
     v->valid = 1;
     v->no_cacheable = 0;
     v->escape = 0;
     v->not_found = 0;
-    v->data = p;
 
-    return NGX_OK;
+    return yy_sec_waf_re_cache_set_value(ctx, name, v);
 }
 
 /*
-** @description: This function is called to get multipart filename.
+** @description: This function is called to get multipart name.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_variable_value_t *v
 ** @para: uintptr_t data
@@ -191,12 +329,9 @@ yy_sec_waf_get_multipart_name(ngx_http_request_t *r,
 */
 
 static ngx_int_t
-yy_sec_waf_get_multipart_filename(ngx_http_request_t *r,
+yy_sec_waf_get_multipart_name(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
-    ngx_uint_t                 i;
-    ngx_str_t                 *var;
-    u_char                    *p;
     ngx_http_request_ctx_t    *ctx;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
@@ -206,32 +341,33 @@ yy_sec_waf_get_multipart_filename(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    var = ctx->multipart_filename.elts;
-
-    for (i = 0; i < ctx->multipart_filename.nelts; i++) {
-        v->len += var[i].len;
-    }
+    return yy_sec_waf_get_multipart(r, v, &yy_sec_waf_multipart_name_name,
+                                    &ctx->multipart_name);
+}
 
-    if (v->len == 0) {
-        v->not_found = 1;
-        return NGX_OK;
-    }
+/*
+** @description: This function is called to get multipart filename.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_variable_value_t *v
+** @para: uintptr_t data
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
 
-    v->data = ngx_palloc(r->pool, v->len);
+static ngx_int_t
+yy_sec_waf_get_multipart_filename(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_request_ctx_t    *ctx;
 
-    p = v->data;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
 
-    for (i = 0; i < ctx->multipart_filename.nelts; i++) {
-        v->data = ngx_cpymem(v->data, var[i].data, var[i].len);
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
     }
 
-    v->valid = 1;
-    v->no_cacheable = 0;
-    v->escape = 0;
-    v->not_found = 0;
-    v->data = p;
-
-    return NGX_OK;
+    return yy_sec_waf_get_multipart(r, v, &yy_sec_waf_multipart_filename_name,
+                                    &ctx->multipart_filename);
 }
 
 /*
@@ -246,9 +382,6 @@ static ngx_int_t
 yy_sec_waf_get_multipart_content_type(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
-    ngx_uint_t                 i;
-    ngx_str_t                 *var;
-    u_char                    *p;
     ngx_http_request_ctx_t    *ctx;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
@@ -258,27 +391,42 @@ yy_sec_waf_get_multipart_content_type(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    var = ctx->content_type.elts;
+    return yy_sec_waf_get_multipart(r, v,
+                                    &yy_sec_waf_multipart_content_type_name,
+                                    &ctx->content_type);
+}
 
-    for (i = 0; i < ctx->content_type.nelts; i++) {
-        v->len += var[i].len;
-    }
+/*
+** @description: This function is called to get the bytes allocated by the
+** variables of the request so far.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_variable_value_t *v
+** @para: uintptr_t data
+** @return: static ngx_int_t.
+*/
+
+static ngx_int_t
+yy_sec_waf_get_alloc_bytes(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                    *p;
+    ngx_http_request_ctx_t    *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
 
-    if (v->len == 0) {
+    if (ctx == NULL) {
         v->not_found = 1;
         return NGX_OK;
     }
 
-    v->data = ngx_palloc(r->pool, v->len);
-
-    p = v->data;
-
-    for (i = 0; i < ctx->content_type.nelts; i++) {
-        v->data = ngx_cpymem(v->data, var[i].data, var[i].len);
+    p = ngx_yy_sec_waf_uitoa(r->pool, ctx->alloc_bytes);
+    if (p == NULL) {
+        return NGX_ERROR;
     }
 
+    v->len = ngx_strlen(p);
     v->valid = 1;
-    v->no_cacheable = 0;
+    v->no_cacheable = 1;
     v->escape = 0;
     v->not_found = 0;
     v->data = p;
@@ -287,7 +435,8 @@ yy_sec_waf_get_multipart_content_type(ngx_http_request_t *r,
 }
 
 /*
-** @description: This function is called to get connection per ip.
+** @description: This function is called to get the bytes of the request
+** copied so far, by the body processor and the variables.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_variable_value_t *v
 ** @para: uintptr_t data
@@ -295,7 +444,7 @@ yy_sec_waf_get_multipart_content_type(ngx_http_request_t *r,
 */
 
 static ngx_int_t
-yy_sec_waf_get_conn_per_ip(ngx_http_request_t *r,
+yy_sec_waf_get_copy_bytes(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
     u_char                    *p;
@@ -308,16 +457,14 @@ yy_sec_waf_get_conn_per_ip(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    if (ctx->conn_per_ip == 0) {
-        v->not_found = 1;
-        return NGX_OK;
+    p = ngx_yy_sec_waf_uitoa(r->pool, ctx->copy_bytes);
+    if (p == NULL) {
+        return NGX_ERROR;
     }
 
-    p = ngx_yy_sec_waf_uitoa(r->pool, ctx->conn_per_ip);
-
     v->len = ngx_strlen(p);
     v->valid = 1;
-    v->no_cacheable = 0;
+    v->no_cacheable = 1;
     v->escape = 0;
     v->not_found = 0;
     v->data = p;
@@ -325,31 +472,335 @@ yy_sec_waf_get_conn_per_ip(ngx_http_request_t *r,
     return NGX_OK;
 }
 
+/*
+** @description: This function is called to decode the names and values of
+** the args parsed since the last call, and to index them by name.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: static ngx_int_t NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+yy_sec_waf_decode_args(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx)
+{
+    u_char                    *p;
+    size_t                     len;
+    ngx_uint_t                 i, n, size;
+    ngx_http_yy_sec_waf_arg_t *arg;
+
+    arg = ctx->args.elts;
+    len = 0;
+
+    for (i = ctx->args_decoded; i < ctx->args.nelts; i++) {
+        len += arg[i].name.len + arg[i].value.len;
+    }
+
+    p = ngx_pnalloc(r->pool, len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->alloc_bytes += len;
+    ctx->copy_bytes += len;
+
+    for (i = ctx->args_decoded; i < ctx->args.nelts; i++) {
+        arg[i].decoded_name.data = p;
+        p = ngx_http_yy_sec_waf_decode_arg(p, &arg[i].name);
+        arg[i].decoded_name.len = p - arg[i].decoded_name.data;
+
+        arg[i].decoded_value.data = p;
+        p = ngx_http_yy_sec_waf_decode_arg(p, &arg[i].value);
+        arg[i].decoded_value.len = p - arg[i].decoded_value.data;
+
+        ngx_yy_sec_waf_crlf_to_space(arg[i].decoded_name.data,
+                                     p - arg[i].decoded_name.data, 1);
+    }
+
+    ctx->args_decoded = ctx->args.nelts;
+
+    for (size = 8; size < 2 * ctx->args.nelts; size <<= 1) { /* void */ }
+
+    ctx->args_hash = ngx_pcalloc(r->pool, size * sizeof(ngx_uint_t));
+    if (ctx->args_hash == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->args_hash_size = size;
+    ctx->alloc_bytes += size * sizeof(ngx_uint_t);
+
+    /* backwards, so that every bucket is in request order */
+    for (i = ctx->args.nelts; i > 0; i--) {
+        n = ngx_hash_key_lc(arg[i - 1].decoded_name.data,
+                            arg[i - 1].decoded_name.len) & (size - 1);
+
+        arg[i - 1].next = ctx->args_hash[n];
+        ctx->args_hash[n] = i;
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to find the collection a rule
+** variable names, like ARGS_GET or ARGS:id.
+** @para: ngx_str_t *name
+** @para: ngx_http_yy_sec_waf_target_t *target
+** @return: NGX_OK or NGX_DECLINED if not a collection.
+*/
+
+ngx_int_t
+yy_sec_waf_re_resolve_collection(ngx_str_t *name,
+    ngx_http_yy_sec_waf_target_t *target)
+{
+    ngx_memzero(target, sizeof(ngx_http_yy_sec_waf_target_t));
+    target->var_index = NGX_ERROR;
+
+    if (name->len == sizeof("ARGS_GET") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "ARGS_GET", name->len) == 0)
+    {
+        target->collection = COLLECTION_ARGS_GET;
+        return NGX_OK;
+    }
+
+    if (name->len == sizeof("ARGS_POST") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "ARGS_POST", name->len) == 0)
+    {
+        target->collection = COLLECTION_ARGS_POST;
+        return NGX_OK;
+    }
+
+    if (name->len == sizeof("ARGS_NAMES") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "ARGS_NAMES", name->len) == 0)
+    {
+        target->collection = COLLECTION_ARGS_NAMES;
+        return NGX_OK;
+    }
+
+    if (name->len == sizeof("JSON_ARGS") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "JSON_ARGS", name->len) == 0)
+    {
+        target->collection = COLLECTION_JSON_ARGS;
+        return NGX_OK;
+    }
+
+    if (name->len == sizeof("JSON_ARGS_NAMES") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "JSON_ARGS_NAMES",
+                           name->len) == 0)
+    {
+        target->collection = COLLECTION_JSON_ARGS_NAMES;
+        return NGX_OK;
+    }
+
+    if (name->len == sizeof("RESPONSE_BODY") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "RESPONSE_BODY",
+                           name->len) == 0)
+    {
+        target->collection = COLLECTION_RESPONSE_BODY;
+        return NGX_OK;
+    }
+
+    if (name->len == sizeof("REQUEST_BODY") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "REQUEST_BODY",
+                           name->len) == 0)
+    {
+        target->collection = COLLECTION_REQUEST_BODY;
+        return NGX_OK;
+    }
+
+    if (name->len > sizeof("ARGS:") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "ARGS:",
+                           sizeof("ARGS:") - 1) == 0)
+    {
+        target->collection = COLLECTION_ARGS_KEY;
+        target->key.data = name->data + sizeof("ARGS:") - 1;
+        target->key.len = name->len - (sizeof("ARGS:") - 1);
+        return NGX_OK;
+    }
+
+    target->collection = COLLECTION_NONE;
+
+    return NGX_DECLINED;
+}
+
+/*
+** @description: This function is called to get the elements of a collection,
+** every arg is decoded once per request whatever the collections using it.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_target_t *target
+** @para: ngx_http_yy_sec_waf_value_t *value
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+yy_sec_waf_re_get_collection(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_target_t *target,
+    ngx_http_yy_sec_waf_value_t *value)
+{
+    ngx_uint_t                 i, n;
+    ngx_str_t                 *str;
+    ngx_array_t               *array;
+    ngx_http_yy_sec_waf_arg_t *arg;
+
+    if (target->collection == COLLECTION_REQUEST_BODY) {
+        value->elts = &ctx->body_window;
+        value->nelts = 0;
+
+        if (ctx->request_body != NULL && ctx->request_body->len) {
+            value->elts = ctx->request_body;
+            value->nelts = 1;
+            ctx->raw_string = ctx->request_body;
+        }
+
+        return NGX_OK;
+    }
+
+    if (target->collection == COLLECTION_RESPONSE_BODY) {
+        value->elts = &ctx->response_window;
+        value->nelts = 0;
+
+        if (ctx->response_body != NULL && ctx->response_body->len) {
+            value->elts = ctx->response_body;
+            value->nelts = 1;
+            ctx->raw_string = ctx->response_body;
+        }
+
+        return NGX_OK;
+    }
+
+    /* decoded by the json tokenizer, nothing to copy */
+    if (target->collection == COLLECTION_JSON_ARGS
+        || target->collection == COLLECTION_JSON_ARGS_NAMES)
+    {
+        value->elts = &ctx->body_window;
+        value->nelts = 0;
+
+        if (ctx->json != NULL) {
+            array = (target->collection == COLLECTION_JSON_ARGS)
+                    ? &ctx->json_args : &ctx->json_names;
+
+            if (array->nelts) {
+                value->elts = array->elts;
+                value->nelts = array->nelts;
+            }
+        }
+
+        return NGX_OK;
+    }
+
+    if (ctx->args.nelts > ctx->args_decoded
+        && yy_sec_waf_decode_args(r, ctx) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    str = ngx_palloc(ctx->scratch_pool,
+                     (ctx->args.nelts + 1) * sizeof(ngx_str_t));
+    if (str == NULL) {
+        return NGX_ERROR;
+    }
+
+    value->elts = str;
+    value->nelts = 0;
+
+    arg = ctx->args.elts;
+
+    switch (target->collection) {
+
+    case COLLECTION_ARGS_KEY:
+
+        if (ctx->args_hash == NULL) {
+            break;
+        }
+
+        n = ngx_hash_key_lc(target->key.data, target->key.len)
+            & (ctx->args_hash_size - 1);
+
+        for (i = ctx->args_hash[n]; i; i = arg[i - 1].next) {
+            if (arg[i - 1].decoded_name.len == target->key.len
+                && ngx_strncasecmp(arg[i - 1].decoded_name.data,
+                                   target->key.data, target->key.len) == 0)
+            {
+                str[value->nelts++] = arg[i - 1].decoded_value;
+            }
+        }
+
+        break;
+
+    case COLLECTION_ARGS_NAMES:
+
+        for (i = 0; i < ctx->args.nelts; i++) {
+            str[value->nelts++] = arg[i].decoded_name;
+        }
+
+        break;
+
+    case COLLECTION_ARGS_GET:
+    case COLLECTION_ARGS_POST:
+
+        for (i = 0; i < ctx->args.nelts; i++) {
+            if (arg[i].flag == (target->collection == COLLECTION_ARGS_GET
+                                ? PROCESS_ARGS : PROCESS_ARGS_POST))
+            {
+                str[value->nelts++] = arg[i].decoded_value;
+            }
+        }
+
+        break;
+
+    default:
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+** The variables built from the body are not cached by nginx, as the request
+** header rules see them before the body is read. Their own cache is reset
+** once the body is processed.
+*/
+
 static ngx_http_variable_t var_metadata[] = {
 
     { ngx_string("ARGS"), NULL, yy_sec_waf_get_args,
-      0, 0, 0 },
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
     { ngx_string("ARGS_POST"), NULL, yy_sec_waf_get_args,
-      0, 0, 0 },
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
     { ngx_string("POST_ARGS_COUNT"), NULL, yy_sec_waf_get_post_args_count,
-      0, 0, 0 },
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ARGS_COUNT"), NULL, yy_sec_waf_get_args_count,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
     { ngx_string("PROCESS_BODY_ERROR"), NULL, yy_sec_waf_get_process_body_error,
-      0, 0, 0 },
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
     { ngx_string("MULTIPART_NAME"), NULL, yy_sec_waf_get_multipart_name,
-      0, 0, 0 },
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
     { ngx_string("MULTIPART_FILENAME"), NULL, yy_sec_waf_get_multipart_filename,
-      0, 0, 0 },
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
     { ngx_string("MULTIPART_CONTENT_TYPE"), NULL, yy_sec_waf_get_multipart_content_type,
-      0, 0, 0 },
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("CONN_PER_IP"), NULL, ngx_http_yy_sec_waf_get_conn,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("REQ_RATE"), NULL, ngx_http_yy_sec_waf_get_rate,
+      0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("WAF_ALLOC_BYTES"), NULL, yy_sec_waf_get_alloc_bytes,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("WAF_COPY_BYTES"), NULL, yy_sec_waf_get_copy_bytes,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-    { ngx_string("CONN_PER_IP"), NULL, yy_sec_waf_get_conn_per_ip,
-      0, 0, 0 },
+    { ngx_string("WAF_REGEX_STATS"), NULL, ngx_http_yy_sec_waf_get_regex_stats,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
     { ngx_null_string, NULL, NULL,
       0, 0, 0 }
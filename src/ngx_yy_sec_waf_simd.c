@@ -0,0 +1,467 @@
+#ifndef YY_SEC_WAF_BENCH
+#include "ngx_yy_sec_waf.h"
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define YY_SEC_WAF_X86  1
+#include <immintrin.h>
+#endif
+
+typedef u_char *(*yy_sec_waf_memmem_pt)(u_char *p, size_t len,
+    u_char *s, size_t n);
+typedef size_t (*yy_sec_waf_plain_len_pt)(u_char *p, size_t len);
+typedef void (*yy_sec_waf_crlf_to_space_pt)(u_char *p, size_t len,
+    ngx_uint_t nul);
+typedef size_t (*yy_sec_waf_count_byte_pt)(u_char *p, size_t len, u_char c);
+
+/*
+** @description: This function is called to search a buffer one byte at a
+** time, it is the fallback of the vector kernels and finishes their tails.
+** @para: u_char *p
+** @para: size_t len
+** @para: u_char *s
+** @para: size_t n (at least 2)
+** @return: static u_char * or NULL if not found.
+*/
+
+static u_char *
+yy_sec_waf_memmem_scalar(u_char *p, size_t len, u_char *s, size_t n)
+{
+    u_char  *last;
+
+    if (n > len) {
+        return NULL;
+    }
+
+    last = p + len - n + 1;
+
+    while (p < last) {
+        p = ngx_strlchr(p, last, s[0]);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        if (ngx_memcmp(p + 1, s + 1, n - 1) == 0) {
+            return p;
+        }
+
+        p++;
+    }
+
+    return NULL;
+}
+
+/*
+** @description: This function is called to count the leading bytes which
+** urldecode copies as they are, that is up to the first '%' or '+'.
+** @para: u_char *p
+** @para: size_t len
+** @return: static size_t
+*/
+
+static size_t
+yy_sec_waf_plain_len_scalar(u_char *p, size_t len)
+{
+    size_t  i;
+
+    for (i = 0; i < len; i++) {
+        if (p[i] == '%' || p[i] == '+') {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/*
+** @description: This function is called to replace '\r' and '\n', and
+** optionally null bytes, with spaces.
+** @para: u_char *p
+** @para: size_t len
+** @para: ngx_uint_t nul
+** @return: static void
+*/
+
+static void
+yy_sec_waf_crlf_to_space_scalar(u_char *p, size_t len, ngx_uint_t nul)
+{
+    size_t  i;
+
+    for (i = 0; i < len; i++) {
+        if (p[i] == '\r' || p[i] == '\n' || (nul && p[i] == '\0')) {
+            p[i] = ' ';
+        }
+    }
+}
+
+/*
+** @description: This function is called to count the occurrences of a byte.
+** @para: u_char *p
+** @para: size_t len
+** @para: u_char c
+** @return: static size_t
+*/
+
+static size_t
+yy_sec_waf_count_byte_scalar(u_char *p, size_t len, u_char c)
+{
+    size_t  i, n;
+
+    for (n = 0, i = 0; i < len; i++) {
+        n += (p[i] == c);
+    }
+
+    return n;
+}
+
+#if (YY_SEC_WAF_X86)
+
+/*
+** @description: This function is called to search a buffer 16 bytes at a
+** time. The first and the last byte of the needle are compared at every
+** offset of the block at once, and only the offsets where both match are
+** compared in full.
+** @para: u_char *p
+** @para: size_t len
+** @para: u_char *s
+** @para: size_t n (at least 2)
+** @return: static u_char * or NULL if not found.
+*/
+
+__attribute__((target("sse2")))
+static u_char *
+yy_sec_waf_memmem_sse2(u_char *p, size_t len, u_char *s, size_t n)
+{
+    size_t    i;
+    unsigned  mask, bit;
+    __m128i   first, last, a, b;
+
+    first = _mm_set1_epi8((char) s[0]);
+    last = _mm_set1_epi8((char) s[n - 1]);
+
+    for (i = 0; i + n - 1 + 16 <= len; i += 16) {
+        a = _mm_loadu_si128((const __m128i *) (p + i));
+        b = _mm_loadu_si128((const __m128i *) (p + i + n - 1));
+
+        mask = (unsigned) _mm_movemask_epi8(
+                   _mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                 _mm_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            bit = __builtin_ctz(mask);
+
+            if (ngx_memcmp(p + i + bit + 1, s + 1, n - 2) == 0) {
+                return p + i + bit;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    return yy_sec_waf_memmem_scalar(p + i, len - i, s, n);
+}
+
+/*
+** @description: This function is called to search a buffer 32 bytes at a
+** time, the same way as the sse2 kernel.
+** @para: u_char *p
+** @para: size_t len
+** @para: u_char *s
+** @para: size_t n (at least 2)
+** @return: static u_char * or NULL if not found.
+*/
+
+__attribute__((target("avx2")))
+static u_char *
+yy_sec_waf_memmem_avx2(u_char *p, size_t len, u_char *s, size_t n)
+{
+    size_t    i;
+    unsigned  mask, bit;
+    __m256i   first, last, a, b;
+
+    first = _mm256_set1_epi8((char) s[0]);
+    last = _mm256_set1_epi8((char) s[n - 1]);
+
+    for (i = 0; i + n - 1 + 32 <= len; i += 32) {
+        a = _mm256_loadu_si256((const __m256i *) (p + i));
+        b = _mm256_loadu_si256((const __m256i *) (p + i + n - 1));
+
+        mask = (unsigned) _mm256_movemask_epi8(
+                   _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                    _mm256_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            bit = __builtin_ctz(mask);
+
+            if (ngx_memcmp(p + i + bit + 1, s + 1, n - 2) == 0) {
+                return p + i + bit;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    return yy_sec_waf_memmem_scalar(p + i, len - i, s, n);
+}
+
+__attribute__((target("sse2")))
+static size_t
+yy_sec_waf_plain_len_sse2(u_char *p, size_t len)
+{
+    size_t    i;
+    unsigned  mask;
+    __m128i   pct, plus, v;
+
+    pct = _mm_set1_epi8('%');
+    plus = _mm_set1_epi8('+');
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (p + i));
+
+        mask = (unsigned) _mm_movemask_epi8(
+                   _mm_or_si128(_mm_cmpeq_epi8(v, pct),
+                                _mm_cmpeq_epi8(v, plus)));
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + yy_sec_waf_plain_len_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+yy_sec_waf_plain_len_avx2(u_char *p, size_t len)
+{
+    size_t    i;
+    unsigned  mask;
+    __m256i   pct, plus, v;
+
+    pct = _mm256_set1_epi8('%');
+    plus = _mm256_set1_epi8('+');
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (p + i));
+
+        mask = (unsigned) _mm256_movemask_epi8(
+                   _mm256_or_si256(_mm256_cmpeq_epi8(v, pct),
+                                   _mm256_cmpeq_epi8(v, plus)));
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + yy_sec_waf_plain_len_scalar(p + i, len - i);
+}
+
+/* blocks without any '\r', '\n' or null byte are not written back */
+
+__attribute__((target("sse2")))
+static void
+yy_sec_waf_crlf_to_space_sse2(u_char *p, size_t len, ngx_uint_t nul)
+{
+    size_t   i;
+    __m128i  cr, lf, zero, sp, v, m;
+
+    cr = _mm_set1_epi8('\r');
+    lf = _mm_set1_epi8('\n');
+    zero = nul ? _mm_setzero_si128() : cr;
+    sp = _mm_set1_epi8(' ');
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (p + i));
+
+        m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                      _mm_cmpeq_epi8(v, lf)),
+                         _mm_cmpeq_epi8(v, zero));
+
+        if (_mm_movemask_epi8(m)) {
+            v = _mm_or_si128(_mm_and_si128(m, sp), _mm_andnot_si128(m, v));
+            _mm_storeu_si128((__m128i *) (p + i), v);
+        }
+    }
+
+    yy_sec_waf_crlf_to_space_scalar(p + i, len - i, nul);
+}
+
+__attribute__((target("avx2")))
+static void
+yy_sec_waf_crlf_to_space_avx2(u_char *p, size_t len, ngx_uint_t nul)
+{
+    size_t   i;
+    __m256i  cr, lf, zero, sp, v, m;
+
+    cr = _mm256_set1_epi8('\r');
+    lf = _mm256_set1_epi8('\n');
+    zero = nul ? _mm256_setzero_si256() : cr;
+    sp = _mm256_set1_epi8(' ');
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (p + i));
+
+        m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+                                            _mm256_cmpeq_epi8(v, lf)),
+                            _mm256_cmpeq_epi8(v, zero));
+
+        if (_mm256_movemask_epi8(m)) {
+            v = _mm256_blendv_epi8(v, sp, m);
+            _mm256_storeu_si256((__m256i *) (p + i), v);
+        }
+    }
+
+    yy_sec_waf_crlf_to_space_scalar(p + i, len - i, nul);
+}
+
+__attribute__((target("sse2,popcnt")))
+static size_t
+yy_sec_waf_count_byte_sse2(u_char *p, size_t len, u_char c)
+{
+    size_t   i, n;
+    __m128i  b;
+
+    b = _mm_set1_epi8((char) c);
+
+    for (n = 0, i = 0; i + 16 <= len; i += 16) {
+        n += __builtin_popcount((unsigned) _mm_movemask_epi8(
+                 _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i)), b)));
+    }
+
+    return n + yy_sec_waf_count_byte_scalar(p + i, len - i, c);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t
+yy_sec_waf_count_byte_avx2(u_char *p, size_t len, u_char c)
+{
+    size_t   i, n;
+    __m256i  b;
+
+    b = _mm256_set1_epi8((char) c);
+
+    for (n = 0, i = 0; i + 32 <= len; i += 32) {
+        n += __builtin_popcount((unsigned) _mm256_movemask_epi8(
+                 _mm256_cmpeq_epi8(
+                     _mm256_loadu_si256((const __m256i *) (p + i)), b)));
+    }
+
+    return n + yy_sec_waf_count_byte_scalar(p + i, len - i, c);
+}
+
+#endif
+
+static yy_sec_waf_memmem_pt  yy_sec_waf_memmem = yy_sec_waf_memmem_scalar;
+static yy_sec_waf_plain_len_pt  yy_sec_waf_plain_len =
+    yy_sec_waf_plain_len_scalar;
+static yy_sec_waf_crlf_to_space_pt  yy_sec_waf_crlf_to_space =
+    yy_sec_waf_crlf_to_space_scalar;
+static yy_sec_waf_count_byte_pt  yy_sec_waf_count_byte =
+    yy_sec_waf_count_byte_scalar;
+
+/*
+** @description: This function is called to select the search kernels for
+** the cpu we are running on.
+** @return: void
+*/
+
+void
+ngx_yy_sec_waf_simd_init(void)
+{
+#if (YY_SEC_WAF_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        yy_sec_waf_memmem = yy_sec_waf_memmem_avx2;
+        yy_sec_waf_plain_len = yy_sec_waf_plain_len_avx2;
+        yy_sec_waf_crlf_to_space = yy_sec_waf_crlf_to_space_avx2;
+        yy_sec_waf_count_byte = yy_sec_waf_count_byte_avx2;
+        return;
+    }
+
+    if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt")) {
+        yy_sec_waf_memmem = yy_sec_waf_memmem_sse2;
+        yy_sec_waf_plain_len = yy_sec_waf_plain_len_sse2;
+        yy_sec_waf_crlf_to_space = yy_sec_waf_crlf_to_space_sse2;
+        yy_sec_waf_count_byte = yy_sec_waf_count_byte_sse2;
+        return;
+    }
+#endif
+
+    yy_sec_waf_memmem = yy_sec_waf_memmem_scalar;
+    yy_sec_waf_plain_len = yy_sec_waf_plain_len_scalar;
+    yy_sec_waf_crlf_to_space = yy_sec_waf_crlf_to_space_scalar;
+    yy_sec_waf_count_byte = yy_sec_waf_count_byte_scalar;
+}
+
+/*
+** @description: This function is called to find the first occurrence of
+** s[0..n) in p[0..len). Unlike ngx_strnstr, neither buffer needs to be
+** null-terminated and both may contain null bytes.
+** @para: u_char *p
+** @para: size_t len
+** @para: u_char *s
+** @para: size_t n
+** @return: u_char * or NULL if not found.
+*/
+
+u_char *
+ngx_yy_sec_waf_memmem(u_char *p, size_t len, u_char *s, size_t n)
+{
+    if (n == 0) {
+        return p;
+    }
+
+    if (n > len) {
+        return NULL;
+    }
+
+    if (n == 1) {
+        return ngx_strlchr(p, p + len, s[0]);
+    }
+
+    return yy_sec_waf_memmem(p, len, s, n);
+}
+
+/*
+** @description: This function is called to count the leading bytes of a
+** buffer which urldecode leaves as they are.
+** @para: u_char *p
+** @para: size_t len
+** @return: size_t
+*/
+
+size_t
+ngx_yy_sec_waf_plain_len(u_char *p, size_t len)
+{
+    return yy_sec_waf_plain_len(p, len);
+}
+
+/*
+** @description: This function is called to replace '\r' and '\n' with
+** spaces, and null bytes as well if nul is set.
+** @para: u_char *p
+** @para: size_t len
+** @para: ngx_uint_t nul
+** @return: void
+*/
+
+void
+ngx_yy_sec_waf_crlf_to_space(u_char *p, size_t len, ngx_uint_t nul)
+{
+    yy_sec_waf_crlf_to_space(p, len, nul);
+}
+
+/*
+** @description: This function is called to count the occurrences of a byte.
+** @para: u_char *p
+** @para: size_t len
+** @para: u_char c
+** @return: size_t
+*/
+
+size_t
+ngx_yy_sec_waf_count_byte(u_char *p, size_t len, u_char c)
+{
+    return yy_sec_waf_count_byte(p, len, c);
+}
@@ -13,7 +13,7 @@ ngx_yy_sec_waf_unescape_uri(u_char **dst, u_char **src, size_t size, ngx_uint_t
 int
 ngx_yy_sec_waf_unescape(ngx_str_t *str) {
     u_char *dst, *src;
-    u_int nullbytes = 0, i;
+    u_int nullbytes = 0;
     
     dst = str->data;
     src = str->data;
@@ -23,12 +23,7 @@ ngx_yy_sec_waf_unescape(ngx_str_t *str) {
     str->len = dst - str->data;
 
     /* tmp hack fix, avoid %00 & co (null byte) encoding :p */
-    for (i = 0; i < str->len; i++) {
-        if (str->data[i] == 0x0) {
-    	    nullbytes++;
-    	    //str->data[i] = '0';
-        }
-    }
+    nullbytes = ngx_yy_sec_waf_count_byte(str->data, str->len, 0x0);
 
     return nullbytes;
 }
@@ -48,6 +43,7 @@ int
 ngx_yy_sec_waf_unescape_uri(u_char **dst, u_char **src, size_t size, ngx_uint_t type)
 {
     u_char  *d, *s, ch, c, decoded;
+    size_t   n;
     int bad = 0;
     
     enum {
@@ -64,6 +60,24 @@ ngx_yy_sec_waf_unescape_uri(u_char **dst, u_char **src, size_t size, ngx_uint_t
 
     while (size--) {
 
+        /* copy the run of bytes which need no decoding at once */
+        if (state == sw_usual && type == 0) {
+            n = ngx_yy_sec_waf_plain_len(s, size + 1);
+
+            if (d != s) {
+                ngx_memmove(d, s, n);
+            }
+
+            d += n;
+            s += n;
+
+            if (n == size + 1) {
+                break;
+            }
+
+            size -= n;
+        }
+
         ch = *s++;
 
         switch (state) {
@@ -0,0 +1,132 @@
+/*
+** Microbenchmark of the substring search kernels, run with "make bench".
+** Every kernel is checked against the scalar one before it is timed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef unsigned char  u_char;
+typedef unsigned long  ngx_uint_t;
+
+#define ngx_memcmp(s1, s2, n)  memcmp((const char *) s1, (const char *) s2, n)
+
+static u_char *
+ngx_strlchr(u_char *p, u_char *last, u_char c)
+{
+    return memchr(p, c, last - p);
+}
+
+#define YY_SEC_WAF_BENCH  1
+#include "../../src/ngx_yy_sec_waf_simd.c"
+
+typedef struct {
+    const char           *name;
+    yy_sec_waf_memmem_pt  search;
+    int                   avail;
+} kernel_t;
+
+static double
+now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(void)
+{
+    size_t     sizes[] = { 1024, 64 * 1024, 1024 * 1024 };
+    size_t     i, j, k, len, n, iters, found;
+    u_char    *buf, *needle, *a, *b;
+    double     t;
+    kernel_t   kernels[] = {
+        { "scalar", yy_sec_waf_memmem_scalar, 1 },
+#if (YY_SEC_WAF_X86)
+        { "sse2", yy_sec_waf_memmem_sse2, 0 },
+        { "avx2", yy_sec_waf_memmem_avx2, 0 },
+#endif
+    };
+
+#if (YY_SEC_WAF_X86)
+    __builtin_cpu_init();
+    kernels[1].avail = __builtin_cpu_supports("sse2");
+    kernels[2].avail = __builtin_cpu_supports("avx2");
+#endif
+
+    needle = (u_char *) "<script";
+    n = strlen((char *) needle);
+
+    buf = malloc(sizes[2] + 1);
+    if (buf == NULL) {
+        return 1;
+    }
+
+    srand(1);
+
+    /* mostly printable noise with many first byte hits, no full match */
+    for (i = 0; i < sizes[2]; i++) {
+        buf[i] = (u_char) ((rand() % 8 == 0) ? '<' : 'a' + rand() % 26);
+    }
+
+    /* correctness, every offset and length near the block edges */
+    for (k = 1; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (!kernels[k].avail) {
+            continue;
+        }
+
+        for (len = n; len < 200; len++) {
+            for (i = 0; i + n <= len; i++) {
+                memcpy(buf + i, needle, n);
+
+                a = yy_sec_waf_memmem_scalar(buf, len, needle, n);
+                b = kernels[k].search(buf, len, needle, n);
+
+                if (a != b) {
+                    printf("%s: mismatch, len %zu, offset %zu\n",
+                           kernels[k].name, len, i);
+                    return 1;
+                }
+
+                buf[i] = 'a';
+            }
+        }
+    }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        len = sizes[i];
+        iters = (256 * 1024 * 1024) / len;
+
+        /* the match is at the very end, so the whole buffer is scanned */
+        memcpy(buf + len - n, needle, n);
+
+        for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            if (!kernels[k].avail) {
+                continue;
+            }
+
+            found = 0;
+            t = now();
+
+            for (j = 0; j < iters; j++) {
+                found += kernels[k].search(buf, len, needle, n) != NULL;
+            }
+
+            t = now() - t;
+
+            printf("%-8s %8zu bytes  %8.2f GB/s  (%zu/%zu)\n", kernels[k].name,
+                   len, (double) len * iters / t / 1e9, found, iters);
+        }
+
+        memset(buf + len - n, 'a', n);
+    }
+
+    free(buf);
+
+    return 0;
+}
@@ -0,0 +1,325 @@
+/*
+** Differential test of the vector kernels against the scalar ones, and of
+** urldecode against the byte at a time decoder it replaced. Run it with
+** "make unit".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+typedef unsigned char  u_char;
+typedef long           ngx_int_t;
+typedef unsigned long  ngx_uint_t;
+typedef void           ngx_pool_t;
+
+typedef struct {
+    size_t   len;
+    u_char  *data;
+} ngx_str_t;
+
+#define NGX_OK                  0
+#define NGX_ERROR              -1
+#define NGX_UNESCAPE_URI        1
+#define NGX_UNESCAPE_REDIRECT   2
+
+#define ngx_memcmp(s1, s2, n)  memcmp((const char *) s1, (const char *) s2, n)
+#define ngx_memcpy(dst, src, n)   (void) memcpy(dst, src, n)
+#define ngx_memmove(dst, src, n)  (void) memmove(dst, src, n)
+#define ngx_strcmp(s1, s2)     strcmp((const char *) s1, (const char *) s2)
+#define ngx_palloc(pool, size)  malloc(size)
+#define ngx_inet_ntop(f, a, t, l)  0
+
+static u_char *
+ngx_strlchr(u_char *p, u_char *last, u_char c)
+{
+    return memchr(p, c, last - p);
+}
+
+#define YY_SEC_WAF_BENCH  1
+#include "../../src/ngx_yy_sec_waf_simd.c"
+
+/* skip the module header, the stubs above stand in for it */
+#define __YY_SEC_WAF_H__  1
+#include "../../src/ngx_yy_sec_waf_utils.c"
+
+/* the decoder as it was before the vector kernels, kept verbatim */
+static int
+reference_unescape_uri(u_char **dst, u_char **src, size_t size, ngx_uint_t type)
+{
+    u_char  *d, *s, ch, c, decoded;
+    int bad = 0;
+    
+    enum {
+        sw_usual = 0,
+        sw_quoted,
+        sw_quoted_second
+    } state;
+
+    d = *dst;
+    s = *src;
+
+    state = 0;
+    decoded = 0;
+
+    while (size--) {
+
+        ch = *s++;
+
+        switch (state) {
+        case sw_usual:
+            if (ch == '?'
+                && (type & (NGX_UNESCAPE_URI|NGX_UNESCAPE_REDIRECT)))
+            {
+                *d++ = ch;
+                goto done;
+            }
+
+            if (ch == '%') {
+                state = sw_quoted;
+                break;
+            }
+
+            // Convert + into space!
+            if (ch == '+') {
+                ch = ' ';
+            }
+
+            *d++ = ch;
+            break;
+
+        case sw_quoted:
+	  
+            if (ch >= '0' && ch <= '9') {
+                decoded = (u_char) (ch - '0');
+                state = sw_quoted_second;
+                break;
+            }
+	    
+            c = (u_char) (ch | 0x20);
+            if (c >= 'a' && c <= 'f') {
+                decoded = (u_char) (c - 'a' + 10);
+                state = sw_quoted_second;
+                break;
+            }
+
+            /* the invalid quoted character */
+	    bad++;
+            state = sw_usual;
+	    *d++ = '%';
+            *d++ = ch;
+            break;
+
+        case sw_quoted_second:
+
+            state = sw_usual;
+
+            if (ch >= '0' && ch <= '9') {
+                ch = (u_char) ((decoded << 4) + ch - '0');
+
+                if (type & NGX_UNESCAPE_REDIRECT) {
+                    if (ch > '%' && ch < 0x7f) {
+                        *d++ = ch;
+                        break;
+                    }
+
+                    *d++ = '%'; *d++ = *(s - 2); *d++ = *(s - 1);
+
+                    break;
+                }
+
+                *d++ = ch;
+
+                break;
+            }
+	    
+            c = (u_char) (ch | 0x20);
+            if (c >= 'a' && c <= 'f') {
+                ch = (u_char) ((decoded << 4) + c - 'a' + 10);
+
+                if (type & NGX_UNESCAPE_URI) {
+                    if (ch == '?') {
+                        *d++ = ch;
+                        goto done;
+                    }
+
+                    *d++ = ch;
+                    break;
+                }
+
+                if (type & NGX_UNESCAPE_REDIRECT) {
+                    if (ch == '?') {
+                        *d++ = ch;
+                        goto done;
+                    }
+
+                    if (ch > '%' && ch < 0x7f) {
+                        *d++ = ch;
+                        break;
+                    }
+
+                    *d++ = '%'; *d++ = *(s - 2); *d++ = *(s - 1);
+                    break;
+                }
+
+                *d++ = ch;
+
+                break;
+            }
+	    /* the invalid quoted character */
+	    /* as it happened in the 2nd part of quoted character, 
+	       we need to restore the decoded char as well. */
+	    *d++ = '%';
+	    *d++ = (0 >= decoded && decoded < 10) ? decoded + '0' : 
+	      decoded - 10 + 'a';
+	    *d++ = ch;
+	    bad++;
+            break;
+        }
+    }
+
+done:
+
+    *dst = d;
+    *src = s;
+    
+    return (bad);
+}
+
+static const u_char  alphabet[] = "ab%+\r\n\0002Ff?=&g9";
+
+static void
+fill(u_char *p, size_t len)
+{
+    size_t  i;
+
+    for (i = 0; i < len; i++) {
+        /* mostly plain bytes, so that runs of every length appear */
+        p[i] = (rand() % 4) ? (u_char) ('a' + rand() % 26)
+                            : alphabet[rand() % (sizeof(alphabet) - 1)];
+    }
+}
+
+static int
+check_kernels(const char *name, yy_sec_waf_plain_len_pt plain_len,
+    yy_sec_waf_crlf_to_space_pt crlf_to_space,
+    yy_sec_waf_count_byte_pt count_byte)
+{
+    u_char      a[512], b[512];
+    size_t      len, off;
+    ngx_uint_t  nul;
+    int         round;
+
+    for (round = 0; round < 20000; round++) {
+        len = rand() % 300;
+        off = rand() % 16;
+
+        fill(a + off, len);
+
+        if (plain_len(a + off, len) != yy_sec_waf_plain_len_scalar(a + off, len)) {
+            printf("%s: plain_len differs, len %zu\n", name, len);
+            return 1;
+        }
+
+        if (count_byte(a + off, len, '\0')
+            != yy_sec_waf_count_byte_scalar(a + off, len, '\0'))
+        {
+            printf("%s: count_byte differs, len %zu\n", name, len);
+            return 1;
+        }
+
+        for (nul = 0; nul < 2; nul++) {
+            memcpy(b, a, sizeof(a));
+
+            crlf_to_space(a + off, len, nul);
+            yy_sec_waf_crlf_to_space_scalar(b + off, len, nul);
+
+            if (memcmp(a, b, sizeof(a)) != 0) {
+                printf("%s: crlf_to_space differs, len %zu\n", name, len);
+                return 1;
+            }
+
+            fill(a + off, len);
+        }
+    }
+
+    return 0;
+}
+
+static int
+check_unescape(const char *name)
+{
+    u_char   in[512], out[512], ref[512], *d, *s, *rd, *rs;
+    size_t   len;
+    int      round, bad, ref_bad;
+
+    for (round = 0; round < 20000; round++) {
+        len = rand() % 300;
+        fill(in, len);
+
+        rd = ref;
+        rs = in;
+        ref_bad = reference_unescape_uri(&rd, &rs, len, 0);
+
+        /* out of place */
+        d = out;
+        s = in;
+        bad = ngx_yy_sec_waf_unescape_uri(&d, &s, len, 0);
+
+        if (bad != ref_bad || d - out != rd - ref || s - in != rs - in
+            || memcmp(out, ref, d - out) != 0)
+        {
+            printf("%s: unescape differs, len %zu\n", name, len);
+            return 1;
+        }
+
+        /* in place, the way the module calls it */
+        d = s = in;
+        bad = ngx_yy_sec_waf_unescape_uri(&d, &s, len, 0);
+
+        if (bad != ref_bad || d - in != rd - ref || memcmp(in, ref, d - in) != 0) {
+            printf("%s: in place unescape differs, len %zu\n", name, len);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int
+main(void)
+{
+    int  rc;
+
+    srand(1);
+
+    rc = check_unescape("scalar");
+
+#if (YY_SEC_WAF_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt")) {
+        rc |= check_kernels("sse2", yy_sec_waf_plain_len_sse2,
+                            yy_sec_waf_crlf_to_space_sse2,
+                            yy_sec_waf_count_byte_sse2);
+
+        yy_sec_waf_plain_len = yy_sec_waf_plain_len_sse2;
+        rc |= check_unescape("sse2");
+    }
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        rc |= check_kernels("avx2", yy_sec_waf_plain_len_avx2,
+                            yy_sec_waf_crlf_to_space_avx2,
+                            yy_sec_waf_count_byte_avx2);
+
+        yy_sec_waf_plain_len = yy_sec_waf_plain_len_avx2;
+        rc |= check_unescape("avx2");
+    }
+#endif
+
+    printf("%s\n", rc ? "FAIL" : "ok");
+
+    return rc;
+}
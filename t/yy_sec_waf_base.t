@@ -5,7 +5,7 @@ use Test::Nginx::Socket;
 
 repeat_each(3);
 
-plan tests => repeat_each(1) * blocks();
+plan tests => repeat_each(1) * (blocks() + 8);
 no_root_location();
 no_long_string();
 $ENV{TEST_NGINX_SERVROOT} = server_root();
@@ -120,3 +120,339 @@ location / {
 --- request
 GET /?for=bar&<script>&args=unlegal
 --- error_code: 200
+
+=== TEST 11: many str rules on one variable
+--- config
+location / {
+    basic_rule ARGS str:union phase:2 id:1001 msg:test gids:SQL lev:LOG|BLOCK;
+    basic_rule ARGS str:select phase:2 id:1002 msg:test gids:SQL lev:LOG|BLOCK;
+    basic_rule ARGS str:script phase:2 id:1003 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?a=foo&b=<script>
+--- error_code: 412
+
+=== TEST 12: many str rules, no match
+--- config
+location / {
+    basic_rule ARGS str:union phase:2 id:1001 msg:test gids:SQL lev:LOG|BLOCK;
+    basic_rule ARGS str:select phase:2 id:1002 msg:test gids:SQL lev:LOG|BLOCK;
+    basic_rule ARGS str:script phase:2 id:1003 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?a=foo&b=bar
+--- error_code: 200
+
+=== TEST 13: regex set, uppercase subject
+--- config
+location / {
+    regex_set on;
+    basic_rule ARGS regex:union\s+select phase:2 id:1001 msg:test gids:SQL lev:LOG|BLOCK;
+    basic_rule ARGS regex:<script|onload= phase:2 id:1002 msg:test gids:XSS lev:LOG|BLOCK;
+    basic_rule ARGS regex:\d+ phase:2 id:1003 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?a=foo&b=UNION%20SELECT
+--- error_code: 412
+
+=== TEST 14: regex set, no literal present
+--- config
+location / {
+    regex_set on;
+    basic_rule ARGS regex:union\s+select phase:2 id:1001 msg:test gids:SQL lev:LOG|BLOCK;
+    basic_rule ARGS regex:<script|onload= phase:2 id:1002 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?a=foo&b=bar
+--- error_code: 200
+
+=== TEST 15: tfn applied before str
+--- config
+location / {
+    basic_rule ARGS str:<script phase:2 id:1001 msg:test gids:XSS t:urldecode lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?a=%253Cscript
+--- error_code: 412
+
+=== TEST 16: one argument targeted by name
+--- config
+location / {
+    basic_rule ARGS:id str:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?a=script&id=1
+--- error_code: 200
+
+=== TEST 17: argument names
+--- config
+location / {
+    basic_rule ARGS_NAMES str:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?%73cript=1
+--- error_code: 412
+
+=== TEST 18: body over the limit refused before it is read
+--- config
+location / {
+    body_limit 8;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+POST /
+a=0123456789
+--- error_code: 413
+
+=== TEST 19: streamed body
+--- skip_nginx: 1: < 1.7.11
+--- config
+location / {
+    body_streaming on;
+    basic_rule REQUEST_BODY str:<script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+POST /
+a=1&b=<script>
+--- error_code: 412
+
+=== TEST 20: body spooled to a temp file
+--- config
+location / {
+    client_body_buffer_size 1k;
+    basic_rule REQUEST_BODY str:<script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request eval
+"POST /
+a=" . ("x" x 4096) . "&b=<script>"
+--- error_code: 412
+
+=== TEST 21: json leaf values, decoded
+--- config
+location / {
+    basic_rule JSON_ARGS str:<script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- more_headers
+Content-Type: application/json
+--- request
+POST /
+{"a": [1, {"b": "\u003cscript>"}]}
+--- error_code: 412
+
+=== TEST 22: gzip body, inspected inflated
+--- config
+location / {
+    basic_rule REQUEST_BODY str:<script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- more_headers
+Content-Type: application/x-www-form-urlencoded
+Content-Encoding: gzip
+--- request eval
+use IO::Compress::Gzip qw(gzip);
+my $body;
+gzip \"a=1&b=<script>" => \$body;
+"POST /\n" . $body
+--- error_code: 412
+
+=== TEST 23: response body, streamed
+--- config
+location / {
+    basic_rule RESPONSE_BODY str:4111111111111111 phase:4 id:1001 msg:test gids:LEAK lev:LOG;
+    return 200 "card=4111111111111111";
+}
+--- request
+GET /
+--- error_code: 200
+--- error_log
+[ysec_waf] alert, id: 1001
+
+=== TEST 24: response body of a type not inspected
+--- config
+location / {
+    basic_rule RESPONSE_BODY str:4111111111111111 phase:4 id:1001 msg:test gids:LEAK lev:LOG;
+    default_type image/png;
+    return 200 "card=4111111111111111";
+}
+--- request
+GET /
+--- error_code: 200
+--- no_error_log
+[ysec_waf] alert, id: 1001
+
+=== TEST 25: connections counted per key in a zone
+--- http_config
+yy_sec_waf_zone name=API key=$http_x_api_key size=1m;
+--- config
+location / {
+    conn_processor on;
+    basic_rule $CONN_API eq:1 phase:1 id:1001 msg:test gids:DOS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- more_headers
+X-Api-Key: abc
+--- request
+GET /
+--- error_code: 412
+
+=== TEST 26: request rate of a zone, within the rate
+--- http_config
+yy_sec_waf_zone name=PER_IP key=$binary_remote_addr rate=1r/m;
+--- config
+location / {
+    conn_processor on;
+    basic_rule $REQ_RATE eq:0 phase:1 id:1001 msg:test gids:DOS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /
+--- error_code: 412
+
+=== TEST 27: client address in ip_deny_list
+--- user_files
+>>> deny.txt
+# loopback
+127.0.0.0/8
+::1
+--- config
+location / {
+    ip_deny_list $TEST_NGINX_SERVROOT/html/deny.txt;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /
+--- error_code: 412
+
+=== TEST 28: client address in ip_allow_list skips the rules
+--- user_files
+>>> allow.txt
+10.0.0.0/8 127.0.0.1
+--- config
+location / {
+    ip_allow_list $TEST_NGINX_SERVROOT/html/allow.txt;
+    basic_rule ARGS str:foo phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?a=foo
+--- error_code: 200
+
+=== TEST 29: json surrogate pair split across two tokens
+--- config
+location / {
+    basic_rule JSON_ARGS str:<script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- more_headers
+Content-Type: application/json
+--- request eval
+'POST /
+{"x":"' . ("a" x 4092) . '\uD800","\uDC00":1,"y":"<script>"}'
+--- error_code: 412
+
+=== TEST 30: client banned after two blocks, a clean request refused
+--- http_config
+yy_sec_waf_ban blocks=2 window=1m time=1m size=1m;
+--- config
+location / {
+    basic_rule ARGS str:foo phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request eval
+["GET /?a=foo", "GET /?a=foo", "GET /"]
+--- error_code eval
+[412, 412, 412]
+
+=== TEST 31: IPv4 clients of a dual stack listener keyed apart
+--- http_config
+yy_sec_waf_zone name=PER_IP key=$binary_remote_addr rate=1r/m;
+server {
+    listen [::]:1986 ipv6only=off;
+    location / {
+        conn_processor on;
+        basic_rule $REQ_RATE gt:0 phase:1 id:1001 msg:test gids:DOS lev:LOG|BLOCK;
+        root $TEST_NGINX_SERVROOT/html/;
+        index index.html index.htm;
+    }
+}
+--- config
+location /a {
+    proxy_bind 127.0.0.2;
+    proxy_pass http://127.0.0.1:1986/;
+}
+location /b {
+    proxy_bind 127.0.0.3;
+    proxy_pass http://127.0.0.1:1986/;
+}
+--- request eval
+["GET /a", "GET /b"]
+--- error_code eval
+[200, 200]
+
+=== TEST 32: a banned IPv4 client of a dual stack listener bans no other
+--- http_config
+yy_sec_waf_ban blocks=1 window=1m time=1m size=1m;
+server {
+    listen [::]:1986 ipv6only=off;
+    location / {
+        basic_rule ARGS str:foo phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+        root $TEST_NGINX_SERVROOT/html/;
+        index index.html index.htm;
+    }
+}
+--- config
+location /a {
+    proxy_bind 127.0.0.2;
+    proxy_pass http://127.0.0.1:1986/?a=foo;
+}
+location /b {
+    proxy_bind 127.0.0.3;
+    proxy_pass http://127.0.0.1:1986/;
+}
+--- request eval
+["GET /a", "GET /a", "GET /b"]
+--- error_code eval
+[412, 412, 200]
+
+=== TEST 33: regex gate counters of every worker in $WAF_REGEX_STATS
+--- config
+location / {
+    basic_rule ARGS regex:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+location /stats {
+    return 200 $WAF_REGEX_STATS;
+}
+--- request
+GET /stats
+--- response_body
+1001 0 0
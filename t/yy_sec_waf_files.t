@@ -164,3 +164,33 @@ Content-Type: application/x-httpd-php\r
 -----------------------------210801732320936925511223486236--\r
 "
 --- error_code: 200
+
+=== TEST 5: multipart, parsed while the body streams in
+--- skip_nginx: 1: < 1.7.11
+--- user_files
+>>> foobar
+eh yo
+--- config
+location / {
+    body_streaming on;
+    basic_rule MULTIPART_FILENAME "regex:\.jsp|\.php|\.html|\.htm|\.\./" "msg:uncommon filename" phase:2 id:1201 gids:UPLOAD  lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- raw_request eval
+"POST /index.html HTTP/1.1\r
+Host: 127.0.0.1\r
+Connection: Close\r
+Content-Type: multipart/form-data; boundary=--xx\r
+Content-Length: 128\r
+\r
+----xx\r
+Content-Disposition: form-data; name=\"datafile\"; filename=\"shell.php\"\r
+Content-Type: text/plain\r
+\r
+<?php ?>
+\r
+----xx--\r
+"
+--- error_code: 412